@@ -0,0 +1,333 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * maxwell-bench.c
+ *
+ * Copyright (C) 2018 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Author: Juan Pablo Ugarte <ugarte@endlessm.com>
+ *
+ */
+
+/*
+ * Microbenchmarks for the C hot paths, run with `meson test --benchmark`.
+ *
+ * Output is one tab separated line per benchmark:
+ *   name, size (children or pixels), iterations per sample,
+ *   median and minimum nanoseconds per iteration over BENCH_SAMPLES samples
+ *
+ * Benchmarks that need children are skipped without a display.
+ */
+
+#include <stdlib.h>
+
+/* We want to measure static functions */
+#include "maxwell-web-view.c"
+#include "maxwell-frame.h"
+
+#define BENCH_SAMPLES  9
+#define BENCH_MIN_TIME 20000  /* Minimum sample duration in microseconds */
+
+typedef void (*BenchFunc) (gpointer data, guint iterations);
+
+static const guint children_sizes[] = { 1, 10, 100, 1000, 10000 };
+static const guint pixel_sizes[] = { 16, 64, 256, 1024 };
+
+static gint
+compare_double (gconstpointer a, gconstpointer b)
+{
+  gdouble da = *(const gdouble *) a;
+  gdouble db = *(const gdouble *) b;
+
+  return (da > db) - (da < db);
+}
+
+static void
+bench_run (const gchar *name, guint size, BenchFunc func, gpointer data)
+{
+  gdouble samples[BENCH_SAMPLES];
+  guint iterations = 1;
+  gint64 start, elapsed;
+  gint i;
+
+  /* Calibrate so every sample runs long enough to be stable */
+  for (;;)
+    {
+      start = g_get_monotonic_time ();
+      func (data, iterations);
+      elapsed = g_get_monotonic_time () - start;
+
+      if (elapsed >= BENCH_MIN_TIME || iterations >= (1 << 24))
+        break;
+
+      iterations *= 2;
+    }
+
+  for (i = 0; i < BENCH_SAMPLES; i++)
+    {
+      start = g_get_monotonic_time ();
+      func (data, iterations);
+      samples[i] = (g_get_monotonic_time () - start) * 1000.0 / iterations;
+    }
+
+  qsort (samples, BENCH_SAMPLES, sizeof (gdouble), compare_double);
+
+  g_print ("%s\t%u\t%u\t%.1f\t%.1f\n", name, size, iterations,
+           samples[BENCH_SAMPLES / 2], samples[0]);
+}
+
+static JSValueRef
+js_eval (JSGlobalContextRef context, const gchar *script)
+{
+  JSStringRef str = JSStringCreateWithUTF8CString (script);
+  JSValueRef retval = JSEvaluateScript (context, str, NULL, NULL, 0, NULL);
+
+  JSStringRelease (str);
+  JSValueProtect (context, retval);
+
+  return retval;
+}
+
+/* Pixel conversion */
+
+typedef struct
+{
+  guint8 *src;
+  guint8 *dst;
+  gint    size;
+} ConvertBench;
+
+static void
+bench_convert (ConvertBench *bench, guint iterations)
+{
+  guint i;
+
+  for (i = 0; i < iterations; i++)
+    _maxwell_frame_convert (bench->dst, bench->src, bench->size * 4,
+                            bench->size, bench->size);
+}
+
+static void
+run_convert_benchmarks (void)
+{
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (pixel_sizes); i++)
+    {
+      ConvertBench bench;
+      gsize len, j;
+
+      bench.size = pixel_sizes[i];
+      len = (gsize) bench.size * bench.size * 4;
+      bench.src = g_malloc (len);
+      bench.dst = g_malloc (len);
+
+      /* Mix of transparent, opaque and translucent pixels like real widgets */
+      for (j = 0; j < len / 4; j++)
+        {
+          guint32 alpha = (j % 3 == 0) ? 0 : (j % 3 == 1) ? 0xff : 0x80;
+          ((guint32 *) bench.src)[j] = alpha << 24 | (j & 0x7f7f7f & (alpha * 0x010101));
+        }
+
+      bench_run ("frame_convert", bench.size * bench.size,
+                 (BenchFunc) bench_convert, &bench);
+
+      g_free (bench.src);
+      g_free (bench.dst);
+    }
+}
+
+/* JavaScript value helpers */
+
+typedef struct
+{
+  JSGlobalContextRef context;
+  JSObjectRef        object;
+} JsBench;
+
+static void
+bench_js_get_number (JsBench *bench, guint iterations)
+{
+  guint i;
+
+  for (i = 0; i < iterations; i++)
+    _js_object_get_number (bench->context, bench->object, "x");
+}
+
+static void
+bench_js_get_string (JsBench *bench, guint iterations)
+{
+  guint i;
+
+  for (i = 0; i < iterations; i++)
+    g_free (_js_object_get_string (bench->context, bench->object, "id"));
+}
+
+static void
+run_js_benchmarks (JSGlobalContextRef context)
+{
+  JsBench bench;
+  JSValueRef value;
+
+  value = js_eval (context, "({ id: 'child0', x: 10, y: 20 })");
+
+  bench.context = context;
+  bench.object = JSValueToObject (context, value, NULL);
+
+  bench_run ("js_object_get_number", 1, (BenchFunc) bench_js_get_number, &bench);
+  bench_run ("js_object_get_string", 1, (BenchFunc) bench_js_get_string, &bench);
+
+  JSValueUnprotect (context, value);
+}
+
+/* Children */
+
+typedef struct
+{
+  MaxwellWebView    *webview;
+  GPtrArray         *children;
+  JSGlobalContextRef context;
+  JSValueRef         positions;
+} ChildrenBench;
+
+static void
+bench_get_child_data_by_id (ChildrenBench *bench, guint iterations)
+{
+  MaxwellWebViewPrivate *priv = MAXWELL_WEB_VIEW_PRIVATE (bench->webview);
+  guint i;
+
+  for (i = 0; i < iterations; i++)
+    {
+      GtkWidget *child = g_ptr_array_index (bench->children, i % bench->children->len);
+      get_child_data_by_id (priv, gtk_widget_get_name (child));
+    }
+}
+
+static void
+bench_get_child_data_by_child (ChildrenBench *bench, guint iterations)
+{
+  MaxwellWebViewPrivate *priv = MAXWELL_WEB_VIEW_PRIVATE (bench->webview);
+  guint i;
+
+  for (i = 0; i < iterations; i++)
+    get_child_data_by_child (priv, g_ptr_array_index (bench->children,
+                                                      i % bench->children->len));
+}
+
+static void
+bench_pick_offscreen_child (ChildrenBench *bench, guint iterations)
+{
+  guint i;
+
+  /* Children are laid out in a grid of 100 columns of 10x10 cells */
+  for (i = 0; i < iterations; i++)
+    {
+      guint n = i % bench->children->len;
+      pick_offscreen_child (NULL, (n % 100) * 10 + 4, (n / 100) * 10 + 4,
+                            bench->webview);
+    }
+}
+
+static void
+bench_children_move_resize (ChildrenBench *bench, guint iterations)
+{
+  guint i;
+
+  for (i = 0; i < iterations; i++)
+    children_move_resize (bench->webview, bench->context, bench->positions);
+}
+
+static void
+run_children_benchmarks (JSGlobalContextRef context)
+{
+  guint i, j;
+
+  for (i = 0; i < G_N_ELEMENTS (children_sizes); i++)
+    {
+      guint n = children_sizes[i];
+      ChildrenBench bench;
+      gchar *script;
+
+      bench.webview = g_object_ref_sink (maxwell_web_view_new ());
+      bench.children = g_ptr_array_new ();
+      bench.context = context;
+
+      for (j = 0; j < n; j++)
+        {
+          GtkWidget *child = gtk_label_new (NULL);
+          gchar *name = g_strdup_printf ("child%u", j);
+
+          gtk_widget_set_name (child, name);
+          gtk_container_add (GTK_CONTAINER (bench.webview), child);
+          g_ptr_array_add (bench.children, child);
+          g_free (name);
+        }
+
+      /* Same message maxwell-web-view.js update_position_size() would post */
+      script = g_strdup_printf ("(function (n) {"
+                                "  let positions = [];"
+                                "  for (let i = 0; i < n; i++)"
+                                "    positions.push({"
+                                "      id: 'child' + i,"
+                                "      x: (i % 100) * 10, y: Math.floor(i / 100) * 10,"
+                                "      width: 8, height: 8,"
+                                "      visible_x: 0, visible_y: 0,"
+                                "      visible_width: 8, visible_height: 8"
+                                "    });"
+                                "  return positions;"
+                                "})(%u)", n);
+      bench.positions = js_eval (context, script);
+      g_free (script);
+
+      /* Set children positions for pick_offscreen_child() */
+      children_move_resize (bench.webview, context, bench.positions);
+
+      bench_run ("get_child_data_by_id", n,
+                 (BenchFunc) bench_get_child_data_by_id, &bench);
+      bench_run ("get_child_data_by_child", n,
+                 (BenchFunc) bench_get_child_data_by_child, &bench);
+      bench_run ("pick_offscreen_child", n,
+                 (BenchFunc) bench_pick_offscreen_child, &bench);
+      bench_run ("children_move_resize", n,
+                 (BenchFunc) bench_children_move_resize, &bench);
+
+      JSValueUnprotect (context, bench.positions);
+      g_ptr_array_unref (bench.children);
+      gtk_widget_destroy (GTK_WIDGET (bench.webview));
+      g_object_unref (bench.webview);
+    }
+}
+
+int
+main (int argc, char *argv[])
+{
+  gboolean have_display = gtk_init_check (&argc, &argv);
+  JSGlobalContextRef context = JSGlobalContextCreate (NULL);
+
+  g_print ("benchmark\tsize\titerations\tmedian_ns\tmin_ns\n");
+
+  run_convert_benchmarks ();
+  run_js_benchmarks (context);
+
+  if (have_display)
+    run_children_benchmarks (context);
+  else
+    g_printerr ("No display available, skipping children benchmarks\n");
+
+  JSGlobalContextRelease (context);
+
+  return 0;
+}
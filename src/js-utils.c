@@ -23,6 +23,7 @@
  */
 
 #include "js-utils.h"
+#include "maxwell-trace.h"
 
 static void
 _js_run_finish_handler (GObject *object, GAsyncResult *result, gpointer data)
@@ -48,8 +49,12 @@ _js_run_finish_handler (GObject *object, GAsyncResult *result, gpointer data)
   g_free (function);
 }
 
+/*
+ * @trace_id is the view id scripts are recorded with in MAXWELL_TRACE
+ */
 void
 _js_run_printf (WebKitWebView *webview,
+                guint          trace_id,
                 GCancellable  *cancellable,
                 const gchar   *function,
                 const gchar   *format,
@@ -62,6 +67,8 @@ _js_run_printf (WebKitWebView *webview,
   script = g_strdup_vprintf (format, args);
   va_end (args);
 
+  _maxwell_trace_script (trace_id, script);
+
   webkit_web_view_run_javascript (WEBKIT_WEB_VIEW (webview),
                                   script,
                                   cancellable,
@@ -72,16 +79,20 @@ _js_run_printf (WebKitWebView *webview,
 
 void
 _js_run_string (WebKitWebView *webview,
+                guint          trace_id,
                 GCancellable  *cancellable,
                 const gchar   *function,
                 GString       *script)
 {
-  if (script && script->len)
-    webkit_web_view_run_javascript (WEBKIT_WEB_VIEW (webview),
-                                    script->str,
-                                    cancellable,
-                                    _js_run_finish_handler,
-                                    g_strdup (function));
+  if (!script || !script->len)
+    return;
+
+  _maxwell_trace_script (trace_id, script->str);
+  webkit_web_view_run_javascript (WEBKIT_WEB_VIEW (webview),
+                                  script->str,
+                                  cancellable,
+                                  _js_run_finish_handler,
+                                  g_strdup (function));
 }
 
 gchar *
@@ -31,15 +31,17 @@
 #include <JavaScriptCore/JSStringRef.h>
 
 G_BEGIN_DECLS
-#define js_run_string(w,c,s) _js_run_string (WEBKIT_WEB_VIEW (w), c, __func__, s)
-#define js_run_printf(w,c,f,...) _js_run_printf (WEBKIT_WEB_VIEW (w), c, __func__, f, __VA_ARGS__)
+#define js_run_string(w,i,c,s) _js_run_string (WEBKIT_WEB_VIEW (w), i, c, __func__, s)
+#define js_run_printf(w,i,c,f,...) _js_run_printf (WEBKIT_WEB_VIEW (w), i, c, __func__, f, __VA_ARGS__)
 
 void        _js_run_string         (WebKitWebView *webview,
+                                    guint          trace_id,
                                     GCancellable  *cancellable,
                                     const gchar   *function,
                                     GString       *script);
 
 void        _js_run_printf         (WebKitWebView *webview,
+                                    guint          trace_id,
                                     GCancellable  *cancellable,
                                     const gchar   *function,
                                     const gchar   *format,
@@ -0,0 +1,560 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * maxwell-broker.c
+ *
+ * Copyright (C) 2018 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Author: Juan Pablo Ugarte <ugarte@endlessm.com>
+ *
+ */
+
+#include "maxwell.h"
+#include "maxwell-broker.h"
+#include "maxwell-frame.h"
+#include "maxwell-frame-stream.h"
+#include "maxwell-trace.h"
+
+/*
+ * MaxwellBroker:
+ *
+ * There is one broker per WebKitWebContext, it owns the maxwell:// URI scheme
+ * handler and every frame waiting to be fetched by any MaxwellWebView using
+ * that context.
+ *
+ * Frames are addressed as maxwell:///view_id/frame_id so a request is routed
+ * to its owner with two hash table lookups no matter how many views share
+ * the web process.
+ *
+ * The main thread only hands us the captured cairo surface, pixel conversion
+ * runs in place in a thread pool shared by all brokers and the same buffer is
+ * streamed to WebKit. Requests arriving before their frame is ready are
+ * finished once the worker is done.
+ *
+ * Capture surfaces come from a pool shared by every view in the context, a
+ * surface is reused for the next capture of the same size as soon as WebKit
+ * and the workers are done with its pixels.
+ *
+ * Pages can also open maxwell:///view_id/stream, a response that never ends
+ * where frames are written as soon as they are converted, see
+ * MaxwellFrameStream. While it is open, and the page keeps up reading it,
+ * frames are not kept for individual requests.
+ */
+struct _MaxwellBroker
+{
+  guint       ref_count;      /* Context and in flight jobs, main thread only */
+  GHashTable *views;          /* view id -> BrokerView */
+  guint       view_count;     /* View counter, used as id */
+  GQueue      surfaces;       /* Pooled capture surfaces, most recent first */
+};
+
+typedef struct
+{
+  MaxwellWebView *webview;    /* Owner, not referenced */
+  GHashTable     *frames;     /* frame id -> BrokerFrame */
+  guint           frame_count;/* Frame counter, used as id */
+  MaxwellFrameStream *stream; /* Frame stream body, owned by WebKit */
+} BrokerView;
+
+typedef struct
+{
+  GBytes                 *bytes;      /* ImageData pixels, NULL until converted */
+  MaxwellBrokerFetchFunc  fetch;      /* Fetch waiting for bytes */
+  gpointer                fetch_data;
+} BrokerFrame;
+
+typedef struct
+{
+  MaxwellBroker   *broker;
+  guint            view_id;
+  guint            frame_id;
+  cairo_surface_t *surface;   /* Captured pixels, read by the worker */
+  GBytes          *bytes;     /* Worker result */
+  gboolean         streamed;  /* Goes to the view frame stream */
+} BrokerJob;
+
+#define BROKER_DATA_KEY "maxwell-broker"
+
+/* Keep a core for the main loop and WebKit */
+#define BROKER_MAX_THREADS CLAMP ((gint) g_get_num_processors () - 1, 1, 4)
+
+/* Enough for a few frames of every child size in flight */
+#define BROKER_POOL_SIZE 16
+
+static GThreadPool *frame_pool = NULL;
+
+static BrokerFrame *
+broker_frame_new (void)
+{
+  return g_slice_new0 (BrokerFrame);
+}
+
+static void
+broker_frame_free (BrokerFrame *frame)
+{
+  if (frame == NULL)
+    return;
+
+  if (frame->fetch)
+    {
+      GError *error = g_error_new (MAXWELL_ERROR, MAXWELL_ERROR_URI,
+                                   "Frame dropped before it was ready");
+      frame->fetch (NULL, error, frame->fetch_data);
+      g_error_free (error);
+      frame->fetch = NULL;
+    }
+
+  g_clear_pointer (&frame->bytes, g_bytes_unref);
+
+  g_slice_free (BrokerFrame, frame);
+}
+
+static BrokerView *
+broker_view_new (MaxwellWebView *webview)
+{
+  BrokerView *view = g_slice_new0 (BrokerView);
+
+  view->webview = webview;
+  view->frames = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL,
+                                        (GDestroyNotify) broker_frame_free);
+  return view;
+}
+
+static void
+broker_view_set_stream (BrokerView *view, MaxwellFrameStream *stream)
+{
+  if (view->stream)
+    {
+      g_object_remove_weak_pointer (G_OBJECT (view->stream),
+                                    (gpointer *) &view->stream);
+      _maxwell_frame_stream_end (view->stream);
+    }
+
+  view->stream = stream;
+
+  if (stream)
+    g_object_add_weak_pointer (G_OBJECT (stream), (gpointer *) &view->stream);
+}
+
+static void
+broker_view_free (BrokerView *view)
+{
+  if (view == NULL)
+    return;
+
+  broker_view_set_stream (view, NULL);
+  g_hash_table_unref (view->frames);
+
+  g_slice_free (BrokerView, view);
+}
+
+static void
+maxwell_broker_unref (MaxwellBroker *broker)
+{
+  if (broker == NULL || --broker->ref_count)
+    return;
+
+  g_hash_table_unref (broker->views);
+  g_queue_foreach (&broker->surfaces, (GFunc) cairo_surface_destroy, NULL);
+  g_queue_clear (&broker->surfaces);
+
+  g_slice_free (MaxwellBroker, broker);
+}
+
+static void
+broker_frame_finish (BrokerView *view, guint id, BrokerFrame *frame)
+{
+  MaxwellBrokerFetchFunc fetch = frame->fetch;
+
+  frame->fetch = NULL;
+  fetch (frame->bytes, NULL, frame->fetch_data);
+
+  /* The fetch keeps a reference to the bytes, we are done with this frame */
+  g_hash_table_remove (view->frames, GUINT_TO_POINTER (id));
+}
+
+static gboolean
+broker_job_done (BrokerJob *job)
+{
+  MaxwellBroker *broker = job->broker;
+  BrokerFrame *frame = NULL;
+  BrokerView *view;
+
+  view = g_hash_table_lookup (broker->views, GUINT_TO_POINTER (job->view_id));
+
+  /* The page gives up on streamed frames when the stream is closed */
+  if (job->streamed)
+    {
+      if (view && view->stream)
+        _maxwell_frame_stream_push (view->stream, job->frame_id, job->bytes);
+    }
+  else if (view)
+    frame = g_hash_table_lookup (view->frames, GUINT_TO_POINTER (job->frame_id));
+
+  /* View or frame could be gone by now */
+  if (frame)
+    {
+      frame->bytes = g_steal_pointer (&job->bytes);
+
+      if (frame->fetch)
+        broker_frame_finish (view, job->frame_id, frame);
+    }
+
+  g_clear_pointer (&job->bytes, g_bytes_unref);
+  maxwell_broker_unref (broker);
+  g_slice_free (BrokerJob, job);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+broker_job_run (BrokerJob *job, gpointer user_data)
+{
+  job->bytes = _maxwell_frame_from_surface (job->surface);
+  g_clear_pointer (&job->surface, cairo_surface_destroy);
+
+  g_main_context_invoke (NULL, (GSourceFunc) broker_job_done, job);
+}
+
+static void
+broker_request_finish_error (WebKitURISchemeRequest *request,
+                             GQuark                  domain,
+                             gint                    code,
+                             const gchar            *message)
+{
+  GError *error = g_error_new (domain, code, "%s %s", message,
+                               webkit_uri_scheme_request_get_uri (request));
+  webkit_uri_scheme_request_finish_error (request, error);
+  g_error_free (error);
+}
+
+static void
+on_request_fetch (GBytes                 *bytes,
+                  const GError           *error,
+                  WebKitURISchemeRequest *request)
+{
+  if (bytes)
+    {
+      GInputStream *stream = g_memory_input_stream_new_from_bytes (bytes);
+
+      webkit_uri_scheme_request_finish (request, stream,
+                                        g_bytes_get_size (bytes),
+                                        "application/octet-stream");
+      g_object_unref (stream);
+    }
+  else
+    webkit_uri_scheme_request_finish_error (request, (GError *) error);
+
+  g_object_unref (request);
+}
+
+static MaxwellFrameStream *
+broker_view_open_stream (BrokerView *view)
+{
+  MaxwellFrameStream *stream = _maxwell_frame_stream_new ();
+
+  /* Replaces the previous page stream, if any */
+  broker_view_set_stream (view, stream);
+
+  return stream;
+}
+
+static gboolean
+broker_view_fetch_frame (BrokerView             *view,
+                         guint                   id,
+                         MaxwellBrokerFetchFunc  func,
+                         gpointer                user_data)
+{
+  BrokerFrame *frame = NULL;
+
+  if (id)
+    frame = g_hash_table_lookup (view->frames, GUINT_TO_POINTER (id));
+
+  /* A frame can only be fetched once */
+  if (!frame || frame->fetch)
+    return FALSE;
+
+  frame->fetch = func;
+  frame->fetch_data = user_data;
+
+  /* Otherwise wait for the worker to convert the pixels */
+  if (frame->bytes)
+    broker_frame_finish (view, id, frame);
+
+  return TRUE;
+}
+
+static void
+on_maxwell_uri_scheme_request (WebKitURISchemeRequest *request,
+                               MaxwellBroker          *broker)
+{
+  WebKitWebView *webview = webkit_uri_scheme_request_get_web_view (request);
+  const gchar *path = webkit_uri_scheme_request_get_path (request);
+  BrokerView *view = NULL;
+  gchar *frame = NULL;
+  guint view_id;
+
+  /*
+   * maxwell:///view_id/frame_id
+   * maxwell:///view_id/stream
+   *
+   * Where 'view_id' is the id the broker gave the MaxwellWebView and
+   * 'frame_id' the id returned by _maxwell_broker_push_frame()
+   */
+  if (path && *path == '/' &&
+      (view_id = g_ascii_strtoull (&path[1], &frame, 10)) &&
+      frame && *frame == '/')
+    view = g_hash_table_lookup (broker->views, GUINT_TO_POINTER (view_id));
+
+  _maxwell_trace_request (view ? view_id : 0, path);
+
+  /* Context can be shared with others WebView */
+  if (!view || WEBKIT_WEB_VIEW (view->webview) != webview)
+    {
+      broker_request_finish_error (request,
+                                   WEBKIT_NETWORK_ERROR,
+                                   WEBKIT_NETWORK_ERROR_UNKNOWN_PROTOCOL,
+                                   "Unknown maxwell:// view");
+      return;
+    }
+
+  if (g_str_equal (&frame[1], "stream"))
+    {
+      MaxwellFrameStream *stream = broker_view_open_stream (view);
+
+      webkit_uri_scheme_request_finish (request, G_INPUT_STREAM (stream), -1,
+                                        "application/octet-stream");
+      g_object_unref (stream);
+      return;
+    }
+
+  /* on_request_fetch() drops the reference, maybe before this returns */
+  if (broker_view_fetch_frame (view, g_ascii_strtoull (&frame[1], NULL, 10),
+                               (MaxwellBrokerFetchFunc) on_request_fetch,
+                               g_object_ref (request)))
+    return;
+
+  broker_request_finish_error (request, MAXWELL_ERROR, MAXWELL_ERROR_URI,
+                               "Could not find image data for");
+  g_object_unref (request);
+}
+
+/*
+ * _maxwell_broker_get_for_context:
+ *
+ * Returns the broker for @context, registering the maxwell:// URI scheme the
+ * first time it is called.
+ */
+MaxwellBroker *
+_maxwell_broker_get_for_context (WebKitWebContext *context)
+{
+  WebKitSecurityManager *security_manager;
+  MaxwellBroker *broker;
+
+  broker = g_object_get_data (G_OBJECT (context), BROKER_DATA_KEY);
+
+  if (broker)
+    return broker;
+
+  broker = g_slice_new0 (MaxwellBroker);
+  broker->ref_count = 1;
+  broker->views = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL,
+                                         (GDestroyNotify) broker_view_free);
+
+  g_object_set_data_full (G_OBJECT (context), BROKER_DATA_KEY, broker,
+                          (GDestroyNotify) maxwell_broker_unref);
+
+  /* Install custom URI scheme to inject image buffers */
+  security_manager = webkit_web_context_get_security_manager (context);
+  webkit_security_manager_register_uri_scheme_as_cors_enabled (security_manager,
+                                                               "maxwell");
+  webkit_web_context_register_uri_scheme (context, "maxwell",
+                                          (WebKitURISchemeRequestCallback) on_maxwell_uri_scheme_request,
+                                          broker, NULL);
+  return broker;
+}
+
+guint
+_maxwell_broker_register_view (MaxwellBroker *broker, MaxwellWebView *webview)
+{
+  guint view_id = ++broker->view_count;
+
+  g_hash_table_insert (broker->views,
+                       GUINT_TO_POINTER (view_id),
+                       broker_view_new (webview));
+  return view_id;
+}
+
+void
+_maxwell_broker_unregister_view (MaxwellBroker *broker, guint view_id)
+{
+  /* Drops every frame the view did not get to fetch */
+  g_hash_table_remove (broker->views, GUINT_TO_POINTER (view_id));
+}
+
+/* Only the pool holds pooled surfaces that are not in use */
+static inline gboolean
+broker_surface_is_idle (cairo_surface_t *surface)
+{
+  return cairo_surface_get_reference_count (surface) == 1;
+}
+
+/*
+ * _maxwell_broker_get_surface:
+ *
+ * Returns an ARGB32 image surface of @width x @height pixels with undefined
+ * contents, from the pool if one of that size is idle. The surface goes
+ * back to the pool once every reference but the pool's is dropped, including
+ * the ones held by bytes returned by _maxwell_frame_from_surface().
+ * Main thread only.
+ */
+cairo_surface_t *
+_maxwell_broker_get_surface (MaxwellBroker *broker, gint width, gint height)
+{
+  cairo_surface_t *surface;
+  GList *l, *idle = NULL;
+
+  for (l = broker->surfaces.head; l; l = l->next)
+    {
+      surface = l->data;
+
+      if (!broker_surface_is_idle (surface))
+        continue;
+
+      if (cairo_image_surface_get_width (surface) == width &&
+          cairo_image_surface_get_height (surface) == height)
+        {
+          /* Move to front, least recently used ones get evicted first */
+          g_queue_unlink (&broker->surfaces, l);
+          g_queue_push_head_link (&broker->surfaces, l);
+          cairo_surface_set_device_scale (surface, 1, 1);
+          return cairo_surface_reference (surface);
+        }
+
+      idle = l;
+    }
+
+  surface = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, width, height);
+
+  if (broker->surfaces.length >= BROKER_POOL_SIZE)
+    {
+      /* Surfaces still in use stay, the new one is just not pooled */
+      if (!idle)
+        return surface;
+
+      cairo_surface_destroy (idle->data);
+      g_queue_delete_link (&broker->surfaces, idle);
+    }
+
+  g_queue_push_head (&broker->surfaces, cairo_surface_reference (surface));
+
+  return surface;
+}
+
+/*
+ * _maxwell_broker_push_frame:
+ *
+ * Takes ownership of @surface, an ARGB32 image surface, queues its
+ * conversion in the worker pool and returns the frame id to use in
+ * maxwell:///view_id/frame_id or 0 if @view_id is not registered.
+ *
+ * @streamed is set to TRUE if the frame will be written to the view frame
+ * stream instead, in which case it can not be requested.
+ */
+guint
+_maxwell_broker_push_frame (MaxwellBroker   *broker,
+                            guint            view_id,
+                            cairo_surface_t *surface,
+                            gboolean        *streamed)
+{
+  BrokerView *view = g_hash_table_lookup (broker->views,
+                                          GUINT_TO_POINTER (view_id));
+  BrokerJob *job;
+  guint id;
+
+  if (!view)
+    {
+      cairo_surface_destroy (surface);
+      return 0;
+    }
+
+  if (!frame_pool)
+    frame_pool = g_thread_pool_new ((GFunc) broker_job_run, NULL,
+                                    BROKER_MAX_THREADS, FALSE, NULL);
+
+  /* Skip 0, it is not a valid id */
+  if (!(id = ++view->frame_count))
+    id = ++view->frame_count;
+
+  job = g_slice_new0 (BrokerJob);
+  job->broker = broker;
+  job->view_id = view_id;
+  job->frame_id = id;
+  job->surface = surface;
+  /* A page that stopped reading gets frames it can request one by one */
+  job->streamed = view->stream &&
+                  _maxwell_frame_stream_is_open (view->stream) &&
+                  !_maxwell_frame_stream_is_full (view->stream);
+
+  if (!job->streamed)
+    g_hash_table_insert (view->frames, GUINT_TO_POINTER (id), broker_frame_new ());
+
+  *streamed = job->streamed;
+  broker->ref_count++;
+
+  g_thread_pool_push (frame_pool, job, NULL);
+
+  return id;
+}
+
+/*
+ * _maxwell_broker_fetch_frame:
+ *
+ * Does what a maxwell:///view_id/frame_id request does, @func is called
+ * with the frame pixels once they are converted, or with an error if the
+ * frame is dropped before that.
+ *
+ * Returns: FALSE if there is no such frame or it was already fetched
+ */
+gboolean
+_maxwell_broker_fetch_frame (MaxwellBroker          *broker,
+                             guint                   view_id,
+                             guint                   frame_id,
+                             MaxwellBrokerFetchFunc  func,
+                             gpointer                user_data)
+{
+  BrokerView *view = g_hash_table_lookup (broker->views,
+                                          GUINT_TO_POINTER (view_id));
+
+  return view && broker_view_fetch_frame (view, frame_id, func, user_data);
+}
+
+/*
+ * _maxwell_broker_open_stream:
+ *
+ * Does what a maxwell:///view_id/stream request does.
+ *
+ * Returns: (transfer full): the new frame stream of @view_id or NULL if
+ *   @view_id is not registered
+ */
+MaxwellFrameStream *
+_maxwell_broker_open_stream (MaxwellBroker *broker, guint view_id)
+{
+  BrokerView *view = g_hash_table_lookup (broker->views,
+                                          GUINT_TO_POINTER (view_id));
+
+  return view ? broker_view_open_stream (view) : NULL;
+}
@@ -0,0 +1,65 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* maxwell-broker.h
+ *
+ * Copyright (C) 2018 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Author: Juan Pablo Ugarte <ugarte@endlessm.com>
+ *
+ */
+
+#ifndef MAXWELL_BROKER_H
+#define MAXWELL_BROKER_H
+
+#include "maxwell-web-view.h"
+#include "maxwell-frame-stream.h"
+
+G_BEGIN_DECLS
+
+typedef struct _MaxwellBroker MaxwellBroker;
+
+typedef void (*MaxwellBrokerFetchFunc) (GBytes       *bytes,
+                                        const GError *error,
+                                        gpointer      user_data);
+
+MaxwellBroker *_maxwell_broker_get_for_context (WebKitWebContext *context);
+
+guint          _maxwell_broker_register_view   (MaxwellBroker  *broker,
+                                                MaxwellWebView *webview);
+
+void           _maxwell_broker_unregister_view (MaxwellBroker  *broker,
+                                                guint           view_id);
+
+guint          _maxwell_broker_push_frame      (MaxwellBroker   *broker,
+                                                guint            view_id,
+                                                cairo_surface_t *surface,
+                                                gboolean        *streamed);
+
+cairo_surface_t *_maxwell_broker_get_surface   (MaxwellBroker *broker,
+                                                gint           width,
+                                                gint           height);
+
+gboolean       _maxwell_broker_fetch_frame     (MaxwellBroker          *broker,
+                                                guint                   view_id,
+                                                guint                   frame_id,
+                                                MaxwellBrokerFetchFunc  func,
+                                                gpointer                user_data);
+
+MaxwellFrameStream *_maxwell_broker_open_stream (MaxwellBroker *broker,
+                                                 guint          view_id);
+G_END_DECLS
+
+#endif /* MAXWELL_BROKER_H */
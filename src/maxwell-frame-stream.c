@@ -0,0 +1,319 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * maxwell-frame-stream.c
+ *
+ * Copyright (C) 2018 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Author: Juan Pablo Ugarte <ugarte@endlessm.com>
+ *
+ */
+
+#include <string.h>
+
+#include "maxwell-frame-stream.h"
+
+/*
+ * MaxwellFrameStream:
+ *
+ * Endless input stream used as the body of the maxwell:///view_id/stream
+ * response. Frames pushed by the broker are appended as records of a
+ * little endian 32 bit frame id, a little endian 32 bit length and the
+ * ImageData pixels, without copying them.
+ *
+ * The stream is pollable so GInputStream default read_async() waits for new
+ * records, and handles cancellation, without blocking a thread.
+ *
+ * Main thread only. It has to be read through the async or pollable API,
+ * blocking reads and skips fail with G_IO_ERROR_WOULD_BLOCK instead of
+ * waiting since nothing could push records meanwhile.
+ *
+ * Records nobody reads are capped at FRAME_STREAM_MAX_QUEUED bytes, see
+ * _maxwell_frame_stream_is_full().
+ */
+struct _MaxwellFrameStream
+{
+  GInputStream  parent;
+
+  GQueue        chunks;       /* GBytes waiting to be read */
+  gsize         offset;       /* Bytes already read from the head chunk */
+  gsize         queued;       /* Bytes waiting to be read */
+  GCancellable *wakeup;       /* Cancelled when there is something to read */
+  gboolean      ended;        /* No more records will be pushed */
+};
+
+/* A few full HD frames */
+#define FRAME_STREAM_MAX_QUEUED (32 * 1024 * 1024)
+
+static void maxwell_frame_stream_pollable_init (GPollableInputStreamInterface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (MaxwellFrameStream, _maxwell_frame_stream, G_TYPE_INPUT_STREAM,
+                         G_IMPLEMENT_INTERFACE (G_TYPE_POLLABLE_INPUT_STREAM,
+                                                maxwell_frame_stream_pollable_init))
+
+static void
+_maxwell_frame_stream_init (MaxwellFrameStream *stream)
+{
+  g_queue_init (&stream->chunks);
+  stream->wakeup = g_cancellable_new ();
+}
+
+static void
+maxwell_frame_stream_clear (MaxwellFrameStream *stream)
+{
+  g_queue_foreach (&stream->chunks, (GFunc) g_bytes_unref, NULL);
+  g_queue_clear (&stream->chunks);
+  stream->offset = 0;
+  stream->queued = 0;
+}
+
+static void
+maxwell_frame_stream_finalize (GObject *object)
+{
+  MaxwellFrameStream *stream = MAXWELL_FRAME_STREAM (object);
+
+  maxwell_frame_stream_clear (stream);
+  g_clear_object (&stream->wakeup);
+
+  G_OBJECT_CLASS (_maxwell_frame_stream_parent_class)->finalize (object);
+}
+
+/* Makes every source created so far dispatch */
+static void
+maxwell_frame_stream_wakeup (MaxwellFrameStream *stream)
+{
+  g_cancellable_cancel (stream->wakeup);
+  g_object_unref (stream->wakeup);
+  stream->wakeup = g_cancellable_new ();
+}
+
+static gboolean
+maxwell_frame_stream_is_readable (GPollableInputStream *pollable)
+{
+  MaxwellFrameStream *stream = MAXWELL_FRAME_STREAM (pollable);
+
+  return stream->ended || !g_queue_is_empty (&stream->chunks);
+}
+
+static gboolean
+maxwell_frame_stream_can_poll (GPollableInputStream *pollable)
+{
+  return TRUE;
+}
+
+static GSource *
+maxwell_frame_stream_create_source (GPollableInputStream *pollable,
+                                    GCancellable         *cancellable)
+{
+  MaxwellFrameStream *stream = MAXWELL_FRAME_STREAM (pollable);
+  GSource *base, *source;
+
+  if (maxwell_frame_stream_is_readable (pollable))
+    base = g_timeout_source_new (0);
+  else
+    base = g_cancellable_source_new (stream->wakeup);
+
+  source = g_pollable_source_new_full (pollable, base, cancellable);
+  g_source_unref (base);
+
+  return source;
+}
+
+static gssize
+maxwell_frame_stream_read_nonblocking (GPollableInputStream  *pollable,
+                                       void                  *buffer,
+                                       gsize                  count,
+                                       GError               **error)
+{
+  MaxwellFrameStream *stream = MAXWELL_FRAME_STREAM (pollable);
+  gsize total = 0;
+
+  if (g_queue_is_empty (&stream->chunks))
+    {
+      if (stream->ended)
+        return 0;
+
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK,
+                           "No frames available");
+      return -1;
+    }
+
+  /* Fill as much of @buffer as we can, records are not kept together */
+  while (total < count && !g_queue_is_empty (&stream->chunks))
+    {
+      GBytes *chunk = g_queue_peek_head (&stream->chunks);
+      gsize size, n;
+      const guint8 *data = g_bytes_get_data (chunk, &size);
+
+      n = MIN (count - total, size - stream->offset);
+      memcpy ((guint8 *) buffer + total, data + stream->offset, n);
+      total += n;
+      stream->offset += n;
+      stream->queued -= n;
+
+      if (stream->offset == size)
+        {
+          g_bytes_unref (g_queue_pop_head (&stream->chunks));
+          stream->offset = 0;
+        }
+    }
+
+  return total;
+}
+
+static gssize
+maxwell_frame_stream_read (GInputStream  *input,
+                           void          *buffer,
+                           gsize          count,
+                           GCancellable  *cancellable,
+                           GError       **error)
+{
+  /* Blocking reads are not supported, nobody could push meanwhile */
+  return maxwell_frame_stream_read_nonblocking (G_POLLABLE_INPUT_STREAM (input),
+                                                buffer, count, error);
+}
+
+static gboolean
+maxwell_frame_stream_close (GInputStream  *input,
+                            GCancellable  *cancellable,
+                            GError       **error)
+{
+  MaxwellFrameStream *stream = MAXWELL_FRAME_STREAM (input);
+
+  stream->ended = TRUE;
+  maxwell_frame_stream_clear (stream);
+
+  return TRUE;
+}
+
+/* Default close_async() runs close_fn in a thread, close right here instead */
+static void
+maxwell_frame_stream_close_async (GInputStream        *input,
+                                  int                  io_priority,
+                                  GCancellable        *cancellable,
+                                  GAsyncReadyCallback  callback,
+                                  gpointer             user_data)
+{
+  GTask *task = g_task_new (input, cancellable, callback, user_data);
+
+  g_task_set_source_tag (task, maxwell_frame_stream_close_async);
+  g_task_return_boolean (task, maxwell_frame_stream_close (input, cancellable, NULL));
+  g_object_unref (task);
+}
+
+static gboolean
+maxwell_frame_stream_close_finish (GInputStream  *input,
+                                   GAsyncResult  *result,
+                                   GError       **error)
+{
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+static void
+_maxwell_frame_stream_class_init (MaxwellFrameStreamClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  GInputStreamClass *input_class = G_INPUT_STREAM_CLASS (klass);
+
+  object_class->finalize = maxwell_frame_stream_finalize;
+
+  input_class->read_fn = maxwell_frame_stream_read;
+  input_class->close_fn = maxwell_frame_stream_close;
+  input_class->close_async = maxwell_frame_stream_close_async;
+  input_class->close_finish = maxwell_frame_stream_close_finish;
+}
+
+static void
+maxwell_frame_stream_pollable_init (GPollableInputStreamInterface *iface)
+{
+  iface->can_poll = maxwell_frame_stream_can_poll;
+  iface->is_readable = maxwell_frame_stream_is_readable;
+  iface->create_source = maxwell_frame_stream_create_source;
+  iface->read_nonblocking = maxwell_frame_stream_read_nonblocking;
+}
+
+MaxwellFrameStream *
+_maxwell_frame_stream_new (void)
+{
+  return g_object_new (MAXWELL_TYPE_FRAME_STREAM, NULL);
+}
+
+/*
+ * _maxwell_frame_stream_is_open:
+ *
+ * Returns: whether records pushed to @stream can still be read
+ */
+gboolean
+_maxwell_frame_stream_is_open (MaxwellFrameStream *stream)
+{
+  return !stream->ended && !g_input_stream_is_closed (G_INPUT_STREAM (stream));
+}
+
+/*
+ * _maxwell_frame_stream_is_full:
+ *
+ * Returns: whether the reader fell so far behind that new frames should not
+ *   be pushed to @stream
+ */
+gboolean
+_maxwell_frame_stream_is_full (MaxwellFrameStream *stream)
+{
+  return stream->queued >= FRAME_STREAM_MAX_QUEUED;
+}
+
+/*
+ * _maxwell_frame_stream_push:
+ *
+ * Appends a record with @bytes, ImageData pixels, for frame @frame_id.
+ *
+ * Returns: FALSE if @stream is not open anymore and the frame was dropped
+ */
+gboolean
+_maxwell_frame_stream_push (MaxwellFrameStream *stream,
+                            guint               frame_id,
+                            GBytes             *bytes)
+{
+  guint32 header[2];
+
+  if (!_maxwell_frame_stream_is_open (stream))
+    return FALSE;
+
+  header[0] = GUINT32_TO_LE (frame_id);
+  header[1] = GUINT32_TO_LE (g_bytes_get_size (bytes));
+
+  g_queue_push_tail (&stream->chunks, g_bytes_new (header, sizeof (header)));
+  g_queue_push_tail (&stream->chunks, g_bytes_ref (bytes));
+  stream->queued += sizeof (header) + g_bytes_get_size (bytes);
+
+  maxwell_frame_stream_wakeup (stream);
+
+  return TRUE;
+}
+
+/*
+ * _maxwell_frame_stream_end:
+ *
+ * Ends @stream, readers get EOF once they consumed every pushed record.
+ */
+void
+_maxwell_frame_stream_end (MaxwellFrameStream *stream)
+{
+  if (stream->ended)
+    return;
+
+  stream->ended = TRUE;
+  maxwell_frame_stream_wakeup (stream);
+}
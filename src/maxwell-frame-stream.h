@@ -0,0 +1,48 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* maxwell-frame-stream.h
+ *
+ * Copyright (C) 2018 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Author: Juan Pablo Ugarte <ugarte@endlessm.com>
+ *
+ */
+
+#ifndef MAXWELL_FRAME_STREAM_H
+#define MAXWELL_FRAME_STREAM_H
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+#define MAXWELL_TYPE_FRAME_STREAM (_maxwell_frame_stream_get_type ())
+G_DECLARE_FINAL_TYPE (MaxwellFrameStream, _maxwell_frame_stream, MAXWELL, FRAME_STREAM, GInputStream)
+
+MaxwellFrameStream *_maxwell_frame_stream_new     (void);
+
+gboolean            _maxwell_frame_stream_is_open (MaxwellFrameStream *stream);
+
+gboolean            _maxwell_frame_stream_is_full (MaxwellFrameStream *stream);
+
+gboolean            _maxwell_frame_stream_push    (MaxwellFrameStream *stream,
+                                                   guint               frame_id,
+                                                   GBytes             *bytes);
+
+void                _maxwell_frame_stream_end     (MaxwellFrameStream *stream);
+
+G_END_DECLS
+
+#endif /* MAXWELL_FRAME_STREAM_H */
@@ -0,0 +1,148 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * maxwell-frame.c
+ *
+ * Copyright (C) 2018 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Author: Juan Pablo Ugarte <ugarte@endlessm.com>
+ *
+ */
+
+#include "maxwell-frame.h"
+
+/*
+ * Pixel helpers shared by the frame pipeline.
+ *
+ * None of these functions touch GTK or WebKit so they are safe to call from
+ * the worker threads.
+ */
+
+/*
+ * _maxwell_frame_convert:
+ *
+ * Converts cairo native endian premultiplied ARGB32 pixels in @src into the
+ * non premultiplied RGBA byte order JavaScript ImageData expects.
+ * @dst rows are packed, ie its stride is @width * 4.
+ *
+ * Every pixel is read before it is written so @dst can be @src.
+ */
+void
+_maxwell_frame_convert (guint8       *dst,
+                        const guint8 *src,
+                        gint          src_stride,
+                        gint          width,
+                        gint          height)
+{
+  gint x, y;
+
+  for (y = 0; y < height; y++)
+    {
+      const guint32 *s = (const guint32 *) (src + y * src_stride);
+
+      for (x = 0; x < width; x++, dst += 4)
+        {
+          guint32 pixel = s[x];
+          guint alpha = pixel >> 24;
+
+          if (alpha == 0)
+            {
+              dst[0] = dst[1] = dst[2] = dst[3] = 0;
+            }
+          else if (alpha == 0xff)
+            {
+              dst[0] = (pixel >> 16) & 0xff;
+              dst[1] = (pixel >> 8) & 0xff;
+              dst[2] = pixel & 0xff;
+              dst[3] = 0xff;
+            }
+          else
+            {
+              dst[0] = ((((pixel >> 16) & 0xff) * 255) + alpha / 2) / alpha;
+              dst[1] = ((((pixel >> 8) & 0xff) * 255) + alpha / 2) / alpha;
+              dst[2] = (((pixel & 0xff) * 255) + alpha / 2) / alpha;
+              dst[3] = alpha;
+            }
+        }
+    }
+}
+
+/*
+ * _maxwell_frame_hash:
+ *
+ * Returns a 64 bit hash of the pixels of the ARGB32 image @surface, used to
+ * recognize identical frames. Not cryptographic, collisions are only
+ * unlikely.
+ */
+guint64
+_maxwell_frame_hash (cairo_surface_t *surface)
+{
+  gint width = cairo_image_surface_get_width (surface);
+  gint height = cairo_image_surface_get_height (surface);
+  gint stride = cairo_image_surface_get_stride (surface);
+  const guint8 *pixels;
+  guint64 hash;
+  gint x, y;
+
+  cairo_surface_flush (surface);
+  pixels = cairo_image_surface_get_data (surface);
+
+  /* Seed with the size so images with the same pixels but different shape
+   * do not match
+   */
+  hash = ((guint64) width << 32 | (guint32) height) ^ G_GUINT64_CONSTANT (0x9e3779b97f4a7c15);
+
+  for (y = 0; y < height; y++)
+    {
+      const guint32 *row = (const guint32 *) (pixels + y * stride);
+
+      for (x = 0; x < width; x++)
+        {
+          hash ^= row[x];
+          hash *= G_GUINT64_CONSTANT (0x100000001b3);
+          hash ^= hash >> 29;
+        }
+    }
+
+  return hash;
+}
+
+/*
+ * _maxwell_frame_from_surface:
+ *
+ * Converts the contents of the ARGB32 image @surface into ImageData pixels
+ * in place and returns them without copying, the returned bytes keep a
+ * reference to @surface.
+ *
+ * @surface contents are not usable as an image afterwards.
+ */
+GBytes *
+_maxwell_frame_from_surface (cairo_surface_t *surface)
+{
+  gint width = cairo_image_surface_get_width (surface);
+  gint height = cairo_image_surface_get_height (surface);
+  guint8 *pixels = cairo_image_surface_get_data (surface);
+
+  cairo_surface_flush (surface);
+  _maxwell_frame_convert (pixels, pixels,
+                          cairo_image_surface_get_stride (surface),
+                          width, height);
+  cairo_surface_mark_dirty (surface);
+
+  return g_bytes_new_with_free_func (pixels, (gsize) width * height * 4,
+                                     (GDestroyNotify) cairo_surface_destroy,
+                                     cairo_surface_reference (surface));
+}
@@ -0,0 +1,43 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* maxwell-frame.h
+ *
+ * Copyright (C) 2018 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Author: Juan Pablo Ugarte <ugarte@endlessm.com>
+ *
+ */
+
+#ifndef MAXWELL_FRAME_H
+#define MAXWELL_FRAME_H
+
+#include <gtk/gtk.h>
+
+G_BEGIN_DECLS
+
+void        _maxwell_frame_convert      (guint8       *dst,
+                                         const guint8 *src,
+                                         gint          src_stride,
+                                         gint          width,
+                                         gint          height);
+
+GBytes     *_maxwell_frame_from_surface (cairo_surface_t *surface);
+
+guint64     _maxwell_frame_hash         (cairo_surface_t *surface);
+
+G_END_DECLS
+
+#endif /* MAXWELL_FRAME_H */
@@ -0,0 +1,417 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * maxwell-trace.c
+ *
+ * Copyright (C) 2018 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Author: Juan Pablo Ugarte <ugarte@endlessm.com>
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "maxwell-trace.h"
+
+/*
+ * Protocol trace
+ *
+ * When MAXWELL_TRACE is set to a filename every MaxwellWebView in the process
+ * appends what goes through the pipeline to it: captured frames with their
+ * pixels, JavaScript commands, geometry messages and maxwell:// requests.
+ * tools/maxwell-replay reads it back to benchmark the pipeline offline.
+ *
+ * File format, all integers are little endian:
+ *
+ *   header:  "MXWTRACE" u32 version
+ *   record:  u32 type, u32 view_id, i64 time, u32 payload length, payload
+ *
+ *   FRAME:    string child, rect area, i32 width, i32 height,
+ *             width * height ARGB32 pixels
+ *   SCRIPT:   string script
+ *   GEOMETRY: string child, rect allocation, rect visible
+ *   REQUEST:  string path
+ *
+ * Where string is u32 length followed by the bytes without nul and rect is
+ * i32 x, y, width, height.
+ */
+
+#define TRACE_MAGIC "MXWTRACE"
+#define TRACE_VERSION 1
+#define TRACE_HEADER_SIZE (sizeof (TRACE_MAGIC) - 1 + 4)
+#define TRACE_RECORD_SIZE (4 + 4 + 8 + 4)
+#define TRACE_RECT_SIZE (4 * 4)
+
+struct _MaxwellTraceReader
+{
+  GMappedFile  *file;
+  const guint8 *data;
+  gsize         len;
+  gsize         pos;
+};
+
+static FILE  *trace_file = NULL;
+static gchar *trace_filename = NULL;
+static gint64 trace_start = 0;
+static guint  trace_users = 0;
+
+static void
+trace_close (void)
+{
+  g_clear_pointer (&trace_file, fclose);
+}
+
+static FILE *
+trace_get_file (void)
+{
+  static gsize initialized = 0;
+
+  if (g_once_init_enter (&initialized))
+    {
+      const gchar *filename = g_getenv (MAXWELL_TRACE_ENV);
+
+      if (filename && *filename)
+        {
+          if ((trace_file = fopen (filename, "wb")))
+            {
+              guint32 version = GUINT32_TO_LE (TRACE_VERSION);
+
+              fwrite (TRACE_MAGIC, sizeof (TRACE_MAGIC) - 1, 1, trace_file);
+              fwrite (&version, sizeof (version), 1, trace_file);
+              fflush (trace_file);
+
+              trace_filename = g_strdup (filename);
+              trace_start = g_get_monotonic_time ();
+              atexit (trace_close);
+            }
+          else
+            g_warning ("Could not open %s trace file %s", MAXWELL_TRACE_ENV, filename);
+        }
+
+      g_once_init_leave (&initialized, 1);
+    }
+
+  return trace_file;
+}
+
+/* Every record is flushed so a crash or kill only loses the one being written */
+static void
+trace_flush (void)
+{
+  fflush (trace_file);
+}
+
+/*
+ * _maxwell_trace_hold:
+ *
+ * Keeps the trace file open, called for every MaxwellWebView. The file is
+ * closed once none is left, and appended to if another one comes later.
+ */
+void
+_maxwell_trace_hold (void)
+{
+  trace_users++;
+
+  if (!trace_get_file () && trace_filename)
+    trace_file = fopen (trace_filename, "ab");
+}
+
+void
+_maxwell_trace_release (void)
+{
+  g_return_if_fail (trace_users > 0);
+
+  if (--trace_users == 0)
+    trace_close ();
+}
+
+static void
+put_u32 (guint32 value)
+{
+  value = GUINT32_TO_LE (value);
+  fwrite (&value, sizeof (value), 1, trace_file);
+}
+
+static void
+put_string (const gchar *str, gsize len)
+{
+  put_u32 (len);
+  fwrite (str, 1, len, trace_file);
+}
+
+static void
+put_rect (GdkRectangle *rect)
+{
+  put_u32 (rect->x);
+  put_u32 (rect->y);
+  put_u32 (rect->width);
+  put_u32 (rect->height);
+}
+
+static void
+put_record (MaxwellTraceType type, guint view_id, gsize payload_len)
+{
+  guint64 time = GUINT64_TO_LE (g_get_monotonic_time () - trace_start);
+
+  put_u32 (type);
+  put_u32 (view_id);
+  fwrite (&time, sizeof (time), 1, trace_file);
+  put_u32 (payload_len);
+}
+
+gboolean
+_maxwell_trace_enabled (void)
+{
+  return trace_get_file () != NULL;
+}
+
+void
+_maxwell_trace_frame (guint            view_id,
+                      const gchar     *child,
+                      GdkRectangle    *area,
+                      cairo_surface_t *image)
+{
+  gint width, height, stride, y;
+  const guint8 *pixels;
+  gsize child_len;
+
+  if (!trace_get_file ())
+    return;
+
+  cairo_surface_flush (image);
+  width = cairo_image_surface_get_width (image);
+  height = cairo_image_surface_get_height (image);
+  stride = cairo_image_surface_get_stride (image);
+  pixels = cairo_image_surface_get_data (image);
+  child_len = strlen (child);
+
+  put_record (MAXWELL_TRACE_FRAME, view_id,
+              4 + child_len + TRACE_RECT_SIZE + 8 + (gsize) width * height * 4);
+  put_string (child, child_len);
+  put_rect (area);
+  put_u32 (width);
+  put_u32 (height);
+
+  for (y = 0; y < height; y++)
+    fwrite (pixels + y * stride, 4, width, trace_file);
+
+  trace_flush ();
+}
+
+void
+_maxwell_trace_script (guint view_id, const gchar *script)
+{
+  gsize len;
+
+  if (!trace_get_file ())
+    return;
+
+  len = strlen (script);
+  put_record (MAXWELL_TRACE_SCRIPT, view_id, 4 + len);
+  put_string (script, len);
+  trace_flush ();
+}
+
+void
+_maxwell_trace_geometry (guint         view_id,
+                         const gchar  *child,
+                         GdkRectangle *alloc,
+                         GdkRectangle *visible)
+{
+  gsize len;
+
+  if (!trace_get_file ())
+    return;
+
+  len = strlen (child);
+  put_record (MAXWELL_TRACE_GEOMETRY, view_id, 4 + len + TRACE_RECT_SIZE * 2);
+  put_string (child, len);
+  put_rect (alloc);
+  put_rect (visible);
+  trace_flush ();
+}
+
+void
+_maxwell_trace_request (guint view_id, const gchar *path)
+{
+  gsize len;
+
+  if (!trace_get_file ())
+    return;
+
+  len = path ? strlen (path) : 0;
+  put_record (MAXWELL_TRACE_REQUEST, view_id, 4 + len);
+  put_string (path, len);
+  trace_flush ();
+}
+
+/* Reader */
+
+MaxwellTraceReader *
+_maxwell_trace_reader_new (const gchar *filename, GError **error)
+{
+  MaxwellTraceReader *reader;
+  GMappedFile *file;
+
+  if (!(file = g_mapped_file_new (filename, FALSE, error)))
+    return NULL;
+
+  if (g_mapped_file_get_length (file) < TRACE_HEADER_SIZE ||
+      memcmp (g_mapped_file_get_contents (file), TRACE_MAGIC, sizeof (TRACE_MAGIC) - 1))
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                   "%s is not a Maxwell trace", filename);
+      g_mapped_file_unref (file);
+      return NULL;
+    }
+
+  reader = g_slice_new0 (MaxwellTraceReader);
+  reader->file = file;
+  reader->data = (const guint8 *) g_mapped_file_get_contents (file);
+  reader->len = g_mapped_file_get_length (file);
+  reader->pos = TRACE_HEADER_SIZE;
+
+  return reader;
+}
+
+void
+_maxwell_trace_reader_free (MaxwellTraceReader *reader)
+{
+  if (reader == NULL)
+    return;
+
+  g_mapped_file_unref (reader->file);
+  g_slice_free (MaxwellTraceReader, reader);
+}
+
+void
+_maxwell_trace_reader_rewind (MaxwellTraceReader *reader)
+{
+  reader->pos = TRACE_HEADER_SIZE;
+}
+
+static guint32
+get_u32 (const guint8 **p)
+{
+  guint32 value;
+
+  memcpy (&value, *p, sizeof (value));
+  *p += sizeof (value);
+
+  return GUINT32_FROM_LE (value);
+}
+
+static void
+get_rect (const guint8 **p, GdkRectangle *rect)
+{
+  rect->x = (gint32) get_u32 (p);
+  rect->y = (gint32) get_u32 (p);
+  rect->width = (gint32) get_u32 (p);
+  rect->height = (gint32) get_u32 (p);
+}
+
+/* Returns FALSE if @len bytes from @p are not inside [@start, @end) */
+static gboolean
+check_len (const guint8 *p, const guint8 *end, gsize len)
+{
+  return p <= end && (gsize) (end - p) >= len;
+}
+
+gboolean
+_maxwell_trace_reader_next (MaxwellTraceReader *reader,
+                            MaxwellTraceEvent  *event)
+{
+  const guint8 *p = reader->data + reader->pos;
+  const guint8 *end;
+  guint64 time;
+  gsize len;
+
+  if (!check_len (p, reader->data + reader->len, TRACE_RECORD_SIZE))
+    return FALSE;
+
+  memset (event, 0, sizeof (MaxwellTraceEvent));
+  event->type = get_u32 (&p);
+  event->view_id = get_u32 (&p);
+  memcpy (&time, p, sizeof (time));
+  p += sizeof (time);
+  event->time = GUINT64_FROM_LE (time);
+  len = get_u32 (&p);
+
+  if (!check_len (p, reader->data + reader->len, len))
+    return FALSE;
+
+  end = p + len;
+  reader->pos = end - reader->data;
+
+  /* Every payload starts with a string */
+  if (!check_len (p, end, 4))
+    return FALSE;
+
+  event->len = get_u32 (&p);
+
+  if (!check_len (p, end, event->len))
+    return FALSE;
+
+  event->data = p;
+  p += event->len;
+
+  switch (event->type)
+    {
+    case MAXWELL_TRACE_FRAME:
+      event->child = (const gchar *) event->data;
+      event->child_len = event->len;
+
+      if (!check_len (p, end, TRACE_RECT_SIZE + 8))
+        return FALSE;
+
+      get_rect (&p, &event->area);
+      event->width = get_u32 (&p);
+      event->height = get_u32 (&p);
+      event->data = p;
+      event->len = end - p;
+
+      if (event->len != (gsize) event->width * event->height * 4)
+        return FALSE;
+      break;
+
+    case MAXWELL_TRACE_GEOMETRY:
+      event->child = (const gchar *) event->data;
+      event->child_len = event->len;
+      event->data = NULL;
+      event->len = 0;
+
+      if (!check_len (p, end, TRACE_RECT_SIZE * 2))
+        return FALSE;
+
+      get_rect (&p, &event->area);
+      get_rect (&p, &event->visible);
+      break;
+
+    case MAXWELL_TRACE_SCRIPT:
+    case MAXWELL_TRACE_REQUEST:
+      break;
+
+    default:
+      /* Unknown record, skip it */
+      event->data = NULL;
+      event->len = 0;
+      break;
+    }
+
+  return TRUE;
+}
@@ -0,0 +1,90 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* maxwell-trace.h
+ *
+ * Copyright (C) 2018 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Author: Juan Pablo Ugarte <ugarte@endlessm.com>
+ *
+ */
+
+#ifndef MAXWELL_TRACE_H
+#define MAXWELL_TRACE_H
+
+#include <gtk/gtk.h>
+
+G_BEGIN_DECLS
+
+#define MAXWELL_TRACE_ENV "MAXWELL_TRACE"
+
+typedef enum {
+  MAXWELL_TRACE_FRAME = 1,    /* Pixels captured from a child */
+  MAXWELL_TRACE_SCRIPT,       /* JavaScript sent to the web process */
+  MAXWELL_TRACE_GEOMETRY,     /* Canvas position and visible area from the DOM */
+  MAXWELL_TRACE_REQUEST       /* maxwell:// request */
+} MaxwellTraceType;
+
+typedef struct
+{
+  MaxwellTraceType type;
+  guint            view_id;   /* 0 if unknown */
+  gint64           time;      /* Microseconds since the trace started */
+  const gchar     *child;     /* Child name, not nul terminated */
+  gsize            child_len;
+  GdkRectangle     area;      /* FRAME area or GEOMETRY allocation */
+  GdkRectangle     visible;   /* GEOMETRY visible area */
+  gint             width;     /* FRAME pixels size */
+  gint             height;
+  const guint8    *data;      /* FRAME ARGB32 pixels or SCRIPT/REQUEST text */
+  gsize            len;
+} MaxwellTraceEvent;
+
+typedef struct _MaxwellTraceReader MaxwellTraceReader;
+
+gboolean            _maxwell_trace_enabled     (void);
+
+void                _maxwell_trace_hold        (void);
+void                _maxwell_trace_release     (void);
+
+void                _maxwell_trace_frame       (guint            view_id,
+                                                const gchar     *child,
+                                                GdkRectangle    *area,
+                                                cairo_surface_t *image);
+
+void                _maxwell_trace_script      (guint            view_id,
+                                                const gchar     *script);
+
+void                _maxwell_trace_geometry    (guint            view_id,
+                                                const gchar     *child,
+                                                GdkRectangle    *alloc,
+                                                GdkRectangle    *visible);
+
+void                _maxwell_trace_request     (guint            view_id,
+                                                const gchar     *path);
+
+MaxwellTraceReader *_maxwell_trace_reader_new  (const gchar      *filename,
+                                                GError          **error);
+
+gboolean            _maxwell_trace_reader_next (MaxwellTraceReader *reader,
+                                                MaxwellTraceEvent  *event);
+
+void                _maxwell_trace_reader_rewind (MaxwellTraceReader *reader);
+
+void                _maxwell_trace_reader_free (MaxwellTraceReader *reader);
+
+G_END_DECLS
+
+#endif /* MAXWELL_TRACE_H */
@@ -23,6 +23,9 @@
  */
 
 #include "maxwell.h"
+#include "maxwell-broker.h"
+#include "maxwell-frame.h"
+#include "maxwell-trace.h"
 #include "js-utils.h"
 
 struct _MaxwellWebView
@@ -38,27 +41,118 @@ typedef struct
   GtkAllocation  alloc;       /* canvas allocation in viewport coordinates */
   gboolean       dom_size;    /* use DOM allocation size */
   GCancellable  *cancellable; /* JavaScript cancellable for this child */
+  GdkRectangle   visible;     /* on screen part of the canvas, in child coordinates */
+  gboolean       visible_set; /* visible was reported by the DOM */
+  cairo_region_t *pending;    /* damage not sent because it was not visible */
+  cairo_region_t *scheduled;  /* damage waiting for the next background flush */
+  gboolean       needs_allocate; /* size or DOM state changed since last allocation */
+  gsize          prerender_bytes; /* canvas memory staged while hidden */
+  gint64         last_visible; /* monotonic time the canvas was last on screen */
+  gboolean       released;    /* offscreen released or not created yet */
+  gboolean       detached;    /* document has no canvas for it */
+  gboolean       thaw_visible; /* visibility changed while frozen */
+  gboolean       thaw_resize; /* size changed while frozen */
+  gint           settle_width; /* DOM size waiting to settle, 0 for none */
+  gint           settle_height;
+  gint64         settle_time; /* When the DOM size is considered settled */
+
+  /* Scrolling since the last frame, see child_send_scroll() */
+  GtkWidget     *scrolled;    /* GtkScrolledWindow that scrolled, weak */
+  gint           scroll_dx;   /* How much its adjustments changed in pixels */
+  gint           scroll_dy;
+  gboolean       scroll_mixed; /* Something else scrolled too */
+
+  /* Child properties */
+  guint          max_fps;     /* 0 for no limit */
+  MaxwellUpdateMode update_mode;
+  gboolean       opaque;      /* child paints every pixel */
+  gint64         next_frame;  /* monotonic time max_fps allows the next frame */
+  gboolean       update_requested; /* maxwell_web_view_update_child() was called */
 } ChildData;
 
-typedef struct
-{
-  guint      id;              /* Unique id */
-  GdkPixbuf *pixbuf;          /* A Pixbuf */
-} PixbufData;
+/* Frames up to this size in bytes are kept in the web process so identical
+ * ones do not have to be transferred again
+ */
+#define FRAME_CACHE_SLOTS    64
+#define FRAME_CACHE_MAX_SIZE (128 * 1024)
+
+/* Frames up to this size in bytes are sent in the draw command itself */
+#define INLINE_THRESHOLD_DEFAULT 4096
 
 typedef struct
 {
-  GList        *children;     /* List of ChildData */
-  GQueue       *pixbufs;      /* List of PixbufData to handle maxwell:// requests */
-  guint         pixbuf_count; /* Pixbuf counter, used as id */
-  GCancellable *cancellable;  /* Global JavaScript cancellable */
+  GList         *children;    /* List of ChildData */
+  MaxwellBroker *broker;      /* Context broker handling maxwell:// requests */
+  guint          view_id;     /* Our id in the broker */
+  GCancellable  *cancellable; /* Global JavaScript cancellable */
+  guint          pending_id;  /* Idle source sending damage that became visible */
+  guint          prerender_id; /* Low priority idle source staging hidden children */
+  gsize          prerender_bytes; /* Sum of children prerender_bytes */
+  guint          flush_id;    /* Timeout sending background children damage */
+  ChildData     *hover;       /* Child under the pointer */
+  GHashTable    *canvases;    /* Canvas ids in the document */
+
+  /* Mirror of the frame cache kept by the web process */
+  struct {
+    guint64 hash;             /* Image hash, see _maxwell_frame_hash() */
+    gint    width;            /* Image size in pixels */
+    gint    height;
+    guint64 last_used;        /* Cache clock, 0 for empty slots */
+  } frame_cache[FRAME_CACHE_SLOTS];
+  guint64        frame_cache_clock;
+
+  guint64        memory_budget; /* Offscreen memory limit in bytes, 0 for none */
+  guint          inline_threshold; /* Max inline frame size in bytes */
+
+  guint          freeze_count; /* maxwell_web_view_freeze_updates() nesting */
+  guint          suspended;   /* SuspendReason flags, holds a freeze */
+  GString       *batch;       /* Commands collected on thaw to run at once */
+  guint          layout_check_id; /* Timeout to re-measure every child */
+  guint          resize_settle_id; /* Timeout applying settled DOM sizes, at
+                                      the earliest child settle_time */
+  gboolean       layout_check_all;
   gboolean      ignore_forall;
+
+  /* Statistics, see maxwell_web_view_get_statistics() */
+  struct {
+    guint64 frames;           /* Frames sent to the web process */
+    guint64 bytes;            /* Pixel bytes in those frames */
+    guint64 damage_single;    /* Damage that was a single rectangle */
+    guint64 damage_split;     /* Damage sent as several rectangles */
+    guint64 damage_union;     /* Several rectangles sent as their bounding box */
+    guint64 prerendered;      /* Hidden children staged ahead of time */
+    guint64 immediate;        /* Damage sent right away for interactive children */
+    guint64 cache_hits;       /* Frames drawn from the web process cache */
+    guint64 inlined;          /* Frames sent in the draw command */
+    guint64 scrolls;          /* Scrolling sent as a copy of the canvas */
+  } stats;
 } MaxwellWebViewPrivate;
 
+/* Reasons nobody can see the page, updates are frozen while any is set */
+typedef enum
+{
+  SUSPEND_UNMAPPED  = 1 << 0, /* unmapped, like a hidden GtkStack page */
+  SUSPEND_ICONIFIED = 1 << 1, /* toplevel minimized */
+  SUSPEND_HIDDEN    = 1 << 2, /* document.visibilityState is hidden */
+} SuspendReason;
+
+enum
+{
+  PROP_0,
+  PROP_MEMORY_BUDGET,
+  PROP_INLINE_THRESHOLD,
+
+  N_PROPERTIES
+};
+
+static GParamSpec *properties[N_PROPERTIES];
+
 enum
 {
   CHILD_PROP_0,
-  CHILD_PROP_CANVAS_ID,
+  CHILD_PROP_MAX_FPS,
+  CHILD_PROP_UPDATE_MODE,
+  CHILD_PROP_OPAQUE,
 
   N_CHILD_PROPERTIES
 };
@@ -66,6 +160,32 @@ enum
 G_DEFINE_TYPE_WITH_PRIVATE (MaxwellWebView, maxwell_web_view, WEBKIT_TYPE_WEB_VIEW)
 
 #define RESOURCES_PATH "/com/endlessm/maxwell"
+
+/* Damage outside the visible area is sent in tiles once it scrolls into view */
+#define TILE_SIZE 128
+
+/* Fixed cost of sending a frame (JS call, request and stream setup)
+ * expressed in bytes, used to decide if it is worth splitting damage
+ */
+#define FRAME_REQUEST_COST 16384
+
+/* Damage of children the user is not interacting with is sent at most once
+ * per interval, in milliseconds
+ */
+#define BACKGROUND_FRAME_INTERVAL 33
+
+/* Maximum canvas memory used by hidden children rendered ahead of time */
+#define PRERENDER_MEMORY_CAP (32 * 1024 * 1024)
+
+/* Time without resizing after which all children are measured again */
+#define LAYOUT_CHECK_TIMEOUT 250
+
+/* Time a DOM size has to stay the same before reallocating the child */
+#define RESIZE_SETTLE_TIMEOUT 50
+
+/* Object data keys used to track GtkScrolledWindow inside children */
+#define SCROLL_TRACKED_KEY "maxwell-scroll-tracked"
+#define SCROLL_VALUE_KEY   "maxwell-scroll-value"
 #define MAXWELL_WEB_VIEW_PRIVATE(d) ((MaxwellWebViewPrivate *) maxwell_web_view_get_instance_private((MaxwellWebView*)d))
 
 static ChildData *
@@ -74,6 +194,8 @@ maxwell_web_view_child_new (GtkWidget *child)
   ChildData *data = g_slice_new0 (ChildData);
 
   data->child = g_object_ref_sink (child);
+  data->needs_allocate = TRUE;
+  data->last_visible = g_get_monotonic_time ();
 
   return data;
 }
@@ -89,6 +211,12 @@ maxwell_web_view_child_free (ChildData *data)
                                   data->offscreen);
 
   g_clear_pointer (&data->offscreen, gdk_window_destroy);
+  g_clear_pointer (&data->pending, cairo_region_destroy);
+  g_clear_pointer (&data->scheduled, cairo_region_destroy);
+
+  if (data->scrolled)
+    g_object_remove_weak_pointer (G_OBJECT (data->scrolled),
+                                  (gpointer *) &data->scrolled);
 
   g_clear_object (&data->child);
 
@@ -113,43 +241,12 @@ MWV_DEFINE_CHILD_GETTER (id, const gchar *, !g_strcmp0 (gtk_widget_get_name (dat
 MWV_DEFINE_CHILD_GETTER (child, GtkWidget *, data->child == child)
 MWV_DEFINE_CHILD_GETTER (offscreen, GdkWindow *, data->offscreen == offscreen)
 
-static PixbufData *
-maxwell_web_view_pixbuf_new (GdkPixbuf *pixbuf, guint id)
-{
-  PixbufData *data = g_slice_new0 (PixbufData);
-
-  data->id = id;
-  data->pixbuf = pixbuf;
-
-  return data;
-}
-
-static void
-maxwell_web_view_pixbuf_free (PixbufData *data)
-{
-  if (data == NULL)
-    return;
-
-  g_clear_object (&data->pixbuf);
-
-  g_slice_free (PixbufData, data);
-}
-
-PixbufData *
-get_pixbuf_data (MaxwellWebViewPrivate *priv, guint id)
+/* Child canvas is display: none or completely clipped by the DOM */
+static inline gboolean
+child_is_hidden (ChildData *data)
 {
-  GList *l;
-
-  if (!priv->pixbufs)
-    return NULL;
-
-  for (l = priv->pixbufs->head; l; l = g_list_next (l))
-    {
-      PixbufData *data = l->data;
-      if (data->id == id)
-        return data;
-    }
-  return NULL;
+  return data->visible_set &&
+         (data->visible.width <= 0 || data->visible.height <= 0);
 }
 
 static void
@@ -157,7 +254,8 @@ maxwell_web_view_init (MaxwellWebView *self)
 {
   MaxwellWebViewPrivate *priv = MAXWELL_WEB_VIEW_PRIVATE (self);
 
-  priv->pixbufs = g_queue_new ();
+  priv->inline_threshold = INLINE_THRESHOLD_DEFAULT;
+  priv->canvases = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
 }
 
 static void
@@ -186,10 +284,56 @@ maxwell_web_view_dispose (GObject *object)
 
   children_cancellable_cancel (MAXWELL_WEB_VIEW (object));
 
-  if (priv->pixbufs)
+  if (priv->pending_id)
+    {
+      g_source_remove (priv->pending_id);
+      priv->pending_id = 0;
+    }
+
+  if (priv->prerender_id)
+    {
+      g_source_remove (priv->prerender_id);
+      priv->prerender_id = 0;
+    }
+
+  if (priv->flush_id)
+    {
+      g_source_remove (priv->flush_id);
+      priv->flush_id = 0;
+    }
+
+  if (priv->layout_check_id)
+    {
+      g_source_remove (priv->layout_check_id);
+      priv->layout_check_id = 0;
+    }
+
+  if (priv->resize_settle_id)
     {
-      g_queue_free_full (priv->pixbufs,(GDestroyNotify) maxwell_web_view_pixbuf_free);
-      priv->pixbufs = NULL;
+      g_source_remove (priv->resize_settle_id);
+      priv->resize_settle_id = 0;
+    }
+
+  if (priv->stats.frames)
+    g_debug ("%p sent %" G_GUINT64_FORMAT " frames, %" G_GUINT64_FORMAT
+             " bytes, %" G_GUINT64_FORMAT " single rectangle damages,"
+             " damage split %" G_GUINT64_FORMAT " times, merged %"
+             G_GUINT64_FORMAT " times, prerendered %" G_GUINT64_FORMAT
+             " times, %" G_GUINT64_FORMAT " immediate updates, %"
+             G_GUINT64_FORMAT " cache hits, %" G_GUINT64_FORMAT " inlined, %"
+             G_GUINT64_FORMAT " scrolls",
+             object, priv->stats.frames, priv->stats.bytes,
+             priv->stats.damage_single,
+             priv->stats.damage_split, priv->stats.damage_union,
+             priv->stats.prerendered, priv->stats.immediate,
+             priv->stats.cache_hits, priv->stats.inlined,
+             priv->stats.scrolls);
+
+  /* Drop any frame still waiting to be fetched */
+  if (priv->view_id)
+    {
+      _maxwell_broker_unregister_view (priv->broker, priv->view_id);
+      priv->view_id = 0;
     }
 
   /* GtkContainer dispose will free children */
@@ -197,84 +341,122 @@ maxwell_web_view_dispose (GObject *object)
 }
 
 static void
-on_maxwell_uri_scheme_request (WebKitURISchemeRequest *request,
-                               gpointer                userdata)
+maxwell_web_view_finalize (GObject *object)
 {
-  WebKitWebView *webview = webkit_uri_scheme_request_get_web_view (request);
-  MaxwellWebViewPrivate *priv;
-  GError *error = NULL;
-  const gchar *path;
-  PixbufData *data;
-  guint id;
-
-  /* Context can be shared with others WebView */
-  if (!MAXWELL_IS_WEB_VIEW (webview))
-    {
-      error = g_error_new (WEBKIT_NETWORK_ERROR,
-                           WEBKIT_NETWORK_ERROR_UNKNOWN_PROTOCOL,
-                           "maxwell:// Unkown protocol");
-      webkit_uri_scheme_request_finish_error (request, error);
-      g_error_free (error);
-      return;
-    }
+  MaxwellWebViewPrivate *priv = MAXWELL_WEB_VIEW_PRIVATE (object);
 
-  priv = MAXWELL_WEB_VIEW_PRIVATE (webview);
-  path = webkit_uri_scheme_request_get_path (request);
-
-  /*
-   * maxwell:///pixbuf_id
-   *
-   * Where 'pixbuf_id' is a GdkPixbuf pointer encoded in base64
-   *
-   * GdkPixbuf are created in damage-event handler and pushed to priv->pixbufs
-   * for us to consume.
-   */
-  if (path && *path == '/' &&
-      (id = g_ascii_strtoll (&path[1], NULL, 10)) &&
-      (data = get_pixbuf_data (priv, id)))
+  g_hash_table_unref (priv->canvases);
+  _maxwell_trace_release ();
+
+  G_OBJECT_CLASS (maxwell_web_view_parent_class)->finalize (object);
+}
+
+static gboolean child_send_pending (MaxwellWebView *webview);
+static void child_queue_prerender (MaxwellWebView *webview, ChildData *data);
+static void child_release_prerender (MaxwellWebView *webview, ChildData *data);
+static void ensure_offscreen (GtkWidget *webview, ChildData *data);
+static void child_release_offscreen (MaxwellWebView *webview, ChildData *data);
+static void child_update_detached (MaxwellWebView *webview, ChildData *data);
+static void child_track_scrolling (GtkWidget *widget, gpointer user_data);
+static void child_scroll_reset (ChildData *data);
+static void children_reclaim (MaxwellWebView *webview);
+static void child_schedule_damage (MaxwellWebView       *webview,
+                                   ChildData            *data,
+                                   const cairo_region_t *damage);
+
+static void
+child_apply_dom_size (ChildData *data, gint width, gint height)
+{
+  data->alloc.width = width;
+  data->alloc.height = height;
+  data->settle_width = data->settle_height = 0;
+  data->needs_allocate = TRUE;
+  gtk_widget_queue_resize (data->child);
+}
+
+static gboolean
+children_settle_resize (MaxwellWebView *webview)
+{
+  MaxwellWebViewPrivate *priv = MAXWELL_WEB_VIEW_PRIVATE (webview);
+  gint64 now = g_get_monotonic_time ();
+  gint64 next = G_MAXINT64;
+  GList *l;
+
+  priv->resize_settle_id = 0;
+
+  for (l = priv->children; l; l = g_list_next (l))
     {
-      const guint8 *pixels = gdk_pixbuf_read_pixels (data->pixbuf);
-      GInputStream *stream = NULL;
-      gsize len;
+      ChildData *data = l->data;
 
-      len = gdk_pixbuf_get_height (data->pixbuf) *
-            gdk_pixbuf_get_rowstride (data->pixbuf);
+      if (!data->settle_width || !data->settle_height)
+        continue;
 
-      stream = g_memory_input_stream_new_from_data (pixels, len, NULL);
-      webkit_uri_scheme_request_finish (request, stream, len,
-                                        "application/octet-stream");
+      if (data->settle_time <= now)
+        child_apply_dom_size (data, data->settle_width, data->settle_height);
+      else
+        next = MIN (next, data->settle_time);
+    }
 
-      /* Add a week reference to free the Pixbuf when stream if finalized */
-      g_object_weak_ref (G_OBJECT (stream),
-                         (GWeakNotify) maxwell_web_view_pixbuf_free,
-                         data);
+  /* Children still changing size wait on their own */
+  if (next != G_MAXINT64)
+    priv->resize_settle_id = g_timeout_add ((next - now + 999) / 1000,
+                                            (GSourceFunc) children_settle_resize,
+                                            webview);
 
-      /* Pixbuf is no longer our responsibility, stream will take care
-       * of freeing it when it's finalized
-       */
-      g_queue_remove (priv->pixbufs, data);
+  return G_SOURCE_REMOVE;
+}
+
+/*
+ * DOM sizes can change on every frame of a window resize or a CSS transition.
+ * Instead of reallocating and rendering each step, the canvas keeps showing
+ * the last frame, clipped by its CSS size, until the size stays the same for
+ * RESIZE_SETTLE_TIMEOUT.
+ *
+ * Each child waits on its own, a transition in one child does not hold the
+ * others back.
+ */
+static void
+child_dom_resize (MaxwellWebView *webview, ChildData *data, gint width, gint height)
+{
+  MaxwellWebViewPrivate *priv = MAXWELL_WEB_VIEW_PRIVATE (webview);
+
+  /* Back to the current size */
+  if (data->alloc.width == width && data->alloc.height == height)
+    {
+      data->settle_width = data->settle_height = 0;
+      return;
+    }
 
-      g_object_unref (stream);
+  data->dom_size = TRUE;
+
+  /* Nothing to show meanwhile */
+  if (!data->alloc.width || !data->alloc.height)
+    {
+      child_apply_dom_size (data, width, height);
       return;
     }
 
-  if (!error)
-    error = g_error_new (MAXWELL_ERROR, MAXWELL_ERROR_URI,
-                         "Could not find image data for %s",
-                         webkit_uri_scheme_request_get_uri (request));
+  /* Still waiting for this size, position updates do not restart the wait */
+  if (data->settle_width == width && data->settle_height == height)
+    return;
+
+  data->settle_width = width;
+  data->settle_height = height;
+  data->settle_time = g_get_monotonic_time () + RESIZE_SETTLE_TIMEOUT * 1000;
 
-  webkit_uri_scheme_request_finish_error (request, error);
-  g_error_free (error);
+  /* A pending timeout fires before this deadline and reschedules itself */
+  if (!priv->resize_settle_id)
+    priv->resize_settle_id = g_timeout_add (RESIZE_SETTLE_TIMEOUT,
+                                            (GSourceFunc) children_settle_resize,
+                                            webview);
 }
 
 static void
-handle_script_message_children_move_resize (WebKitUserContentManager *manager,
-                                            WebKitJavascriptResult   *result,
-                                            MaxwellWebView           *webview)
+children_move_resize (MaxwellWebView     *webview,
+                      JSGlobalContextRef  context,
+                      JSValueRef          value)
 {
   MaxwellWebViewPrivate *priv = MAXWELL_WEB_VIEW_PRIVATE (webview);
-  JSGlobalContextRef context = webkit_javascript_result_get_global_context (result);
-  JSValueRef value = webkit_javascript_result_get_value (result);
   JSObjectRef array;
   JSValueRef val;
   gint i = 0;
@@ -302,18 +484,52 @@ handle_script_message_children_move_resize (WebKitUserContentManager *manager,
           data->alloc.x = _js_object_get_number (context, obj, "x");
           data->alloc.y = _js_object_get_number (context, obj, "y");
 
-          if (w && h && (data->alloc.width != w || data->alloc.height != h))
+          data->visible.x = _js_object_get_number (context, obj, "visible_x");
+          data->visible.y = _js_object_get_number (context, obj, "visible_y");
+          data->visible.width = _js_object_get_number (context, obj, "visible_width");
+          data->visible.height = _js_object_get_number (context, obj, "visible_height");
+          data->visible_set = TRUE;
+
+          _maxwell_trace_geometry (priv->view_id, child_id, &data->alloc, &data->visible);
+
+          /* Send damage that scrolled into view when we are idle */
+          if (data->pending && !priv->pending_id)
+            priv->pending_id = g_idle_add ((GSourceFunc) child_send_pending,
+                                           webview);
+
+          /* Stage hidden children, shown ones no longer count as prerendered */
+          if (data->visible.width > 0 && data->visible.height > 0)
             {
-              data->dom_size = TRUE;
-              data->alloc.width = w;
-              data->alloc.height = h;
-              gtk_widget_queue_resize (data->child);
+              data->last_visible = g_get_monotonic_time ();
+              child_release_prerender (webview, data);
+
+              /* Bring back resources released to stay within budget */
+              if (data->released && !data->detached &&
+                  gtk_widget_get_realized (GTK_WIDGET (webview)))
+                ensure_offscreen (GTK_WIDGET (webview), data);
             }
+          else
+            child_queue_prerender (webview, data);
+
+          if (w && h)
+            child_dom_resize (webview, data, w, h);
         }
 
       g_free (child_id);
       i++;
     }
+
+  children_reclaim (webview);
+}
+
+static void
+handle_script_message_children_move_resize (WebKitUserContentManager *manager,
+                                            WebKitJavascriptResult   *result,
+                                            MaxwellWebView           *webview)
+{
+  children_move_resize (webview,
+                        webkit_javascript_result_get_global_context (result),
+                        webkit_javascript_result_get_value (result));
 }
 
 static void
@@ -368,7 +584,13 @@ child_allocate (MaxwellWebView *webview, ChildData *data)
       g_clear_object (&data->cancellable);
       data->cancellable = g_cancellable_new ();
 
-      js_run_printf (webview, data->cancellable,
+      if (priv->freeze_count)
+        {
+          data->thaw_resize = TRUE;
+          return;
+        }
+
+      js_run_printf (webview, priv->view_id, data->cancellable,
                      "maxwell.child_resize ('%s', %d, %d, %d, %d);\n",
                      gtk_widget_get_name (data->child),
                      alloc.width, alloc.height,
@@ -403,12 +625,35 @@ handle_script_message_children_init (WebKitUserContentManager *manager,
     {
       JSObjectRef obj = JSValueToObject (context, val, NULL);
       gchar *id = _js_object_get_string (context, obj, "id");
-      ChildData *data = get_child_data_by_id (priv, id);
+      ChildData *data;
+
+      if (!id)
+        {
+          i++;
+          continue;
+        }
+
+      data = get_child_data_by_id (priv, id);
+      g_hash_table_add (priv->canvases, g_strdup (id));
+
+      /* First time we see its canvas, or attached again after being removed */
+      if (data && data->detached)
+        child_update_detached (webview, data);
 
       if (data && data->offscreen && data->alloc.width && data->alloc.height)
         {
-          /* Collect children to initialize */
+          /* Damage before the canvas existed was dropped, repaint it */
           if (gtk_widget_get_visible (data->child))
+            gtk_widget_queue_draw (data->child);
+
+          /* Collect children to initialize */
+          if (priv->freeze_count)
+            {
+              /* Sent in one go on thaw */
+              data->thaw_visible = TRUE;
+              data->thaw_resize |= !_js_object_get_number (context, obj, "use_dom_size");
+            }
+          else if (gtk_widget_get_visible (data->child))
             {
               g_string_append_printf (script,
                                       "maxwell.child_set_visible ('%s', true);\n",
@@ -437,10 +682,195 @@ handle_script_message_children_init (WebKitUserContentManager *manager,
     }
 
   /* Initialize all children at once */
-  js_run_string (webview, priv->cancellable, script);
+  js_run_string (webview, priv->view_id, priv->cancellable, script);
   g_string_free (script, TRUE);
 }
 
+static void
+handle_script_message_children_remove (WebKitUserContentManager *manager,
+                                       WebKitJavascriptResult   *result,
+                                       MaxwellWebView           *webview)
+{
+  MaxwellWebViewPrivate *priv = MAXWELL_WEB_VIEW_PRIVATE (webview);
+  JSGlobalContextRef context = webkit_javascript_result_get_global_context (result);
+  JSValueRef value = webkit_javascript_result_get_value (result);
+  JSObjectRef array;
+  JSValueRef val;
+  gint i = 0;
+
+  if (!JSValueIsArray (context, value))
+    {
+      g_warning ("Error running javascript: unexpected return value");
+      return;
+    }
+
+  array = JSValueToObject (context, value, NULL);
+
+  while ((val = JSObjectGetPropertyAtIndex (context, array, i, NULL)) &&
+         JSValueIsString (context, val))
+    {
+      gchar *id = _js_get_string (context, val);
+      ChildData *data;
+
+      if (!id)
+        {
+          i++;
+          continue;
+        }
+
+      data = get_child_data_by_id (priv, id);
+      g_hash_table_remove (priv->canvases, id);
+
+      /* Nobody will see its frames until the canvas is attached again */
+      if (data)
+        {
+          g_cancellable_cancel (data->cancellable);
+          g_clear_object (&data->cancellable);
+          child_update_detached (webview, data);
+        }
+
+      g_free (id);
+      i++;
+    }
+}
+
+/* Sends again every child in @array ids from index @i, their canvas lost its contents */
+static void
+children_repaint (MaxwellWebView     *webview,
+                  JSGlobalContextRef  context,
+                  JSObjectRef         array,
+                  gint                i)
+{
+  MaxwellWebViewPrivate *priv = MAXWELL_WEB_VIEW_PRIVATE (webview);
+  JSValueRef val;
+
+  while ((val = JSObjectGetPropertyAtIndex (context, array, i, NULL)) &&
+         JSValueIsString (context, val))
+    {
+      gchar *id = _js_get_string (context, val);
+      ChildData *data = get_child_data_by_id (priv, id);
+
+      if (data && data->offscreen)
+        {
+          cairo_rectangle_int_t rect = { 0, 0, data->alloc.width, data->alloc.height };
+          cairo_region_t *region = cairo_region_create_rectangle (&rect);
+
+          child_schedule_damage (webview, data, region);
+          cairo_region_destroy (region);
+        }
+
+      g_free (id);
+      i++;
+    }
+}
+
+/*
+ * The page could not store the image for a frame cache slot, the message is
+ * an array with the slot followed by the ids of the children that were
+ * left without it.
+ */
+static void
+handle_script_message_frame_cache_failed (WebKitUserContentManager *manager,
+                                          WebKitJavascriptResult   *result,
+                                          MaxwellWebView           *webview)
+{
+  MaxwellWebViewPrivate *priv = MAXWELL_WEB_VIEW_PRIVATE (webview);
+  JSGlobalContextRef context = webkit_javascript_result_get_global_context (result);
+  JSValueRef value = webkit_javascript_result_get_value (result);
+  JSObjectRef array;
+  guint slot;
+
+  if (!JSValueIsArray (context, value))
+    {
+      g_warning ("Error running javascript: unexpected return value");
+      return;
+    }
+
+  array = JSValueToObject (context, value, NULL);
+  slot = JSValueToNumber (context, JSObjectGetPropertyAtIndex (context, array, 0, NULL), NULL);
+
+  /* Stop pointing children at it */
+  if (slot >= 1 && slot <= FRAME_CACHE_SLOTS)
+    priv->frame_cache[slot - 1].last_used = 0;
+
+  /* And send those that needed it again */
+  children_repaint (webview, context, array, 1);
+}
+
+static void
+handle_script_message_children_repaint (WebKitUserContentManager *manager,
+                                        WebKitJavascriptResult   *result,
+                                        MaxwellWebView           *webview)
+{
+  JSGlobalContextRef context = webkit_javascript_result_get_global_context (result);
+  JSValueRef value = webkit_javascript_result_get_value (result);
+
+  if (!JSValueIsArray (context, value))
+    {
+      g_warning ("Error running javascript: unexpected return value");
+      return;
+    }
+
+  children_repaint (webview, context, JSValueToObject (context, value, NULL), 0);
+}
+
+static void
+handle_script_message_ready (WebKitUserContentManager *manager,
+                             WebKitJavascriptResult   *result,
+                             MaxwellWebView           *webview)
+{
+  MaxwellWebViewPrivate *priv = MAXWELL_WEB_VIEW_PRIVATE (webview);
+
+  /* Support script API is available, start rendering without waiting for
+   * the rest of the page to load
+   */
+  if (!priv->cancellable)
+    priv->cancellable = g_cancellable_new ();
+
+  /* Frames are requested one by one until the page opens the stream */
+  js_run_printf (webview, priv->view_id, priv->cancellable,
+                 "maxwell.frame_stream_open ('maxwell:///%u/stream');",
+                 priv->view_id);
+}
+
+/*
+ * Damage keeps being collected as regions while suspended, every child gets
+ * a single catch-up frame when the page can be seen again.
+ */
+static void
+webview_set_suspended (MaxwellWebView *webview, SuspendReason reason, gboolean suspend)
+{
+  MaxwellWebViewPrivate *priv = MAXWELL_WEB_VIEW_PRIVATE (webview);
+  guint old = priv->suspended;
+
+  if (suspend)
+    priv->suspended |= reason;
+  else
+    priv->suspended &= ~reason;
+
+  if (!old && priv->suspended)
+    {
+      g_debug ("%p suspended", webview);
+      maxwell_web_view_freeze_updates (webview);
+    }
+  else if (old && !priv->suspended)
+    {
+      g_debug ("%p resumed", webview);
+      maxwell_web_view_thaw_updates (webview);
+    }
+}
+
+static void
+handle_script_message_visibility (WebKitUserContentManager *manager,
+                                  WebKitJavascriptResult   *result,
+                                  MaxwellWebView           *webview)
+{
+  JSGlobalContextRef context = webkit_javascript_result_get_global_context (result);
+  JSValueRef value = webkit_javascript_result_get_value (result);
+
+  webview_set_suspended (webview, SUSPEND_HIDDEN, JSValueToBoolean (context, value));
+}
+
 #define EWV_DEFINE_MSG_HANDLER(manager, name, object) \
   g_signal_connect_object (manager, "script-message-received::maxwell_"#name,\
                            G_CALLBACK (handle_script_message_##name),\
@@ -450,10 +880,9 @@ handle_script_message_children_init (WebKitUserContentManager *manager,
 static void
 maxwell_web_view_constructed (GObject *object)
 {
+  MaxwellWebViewPrivate *priv = MAXWELL_WEB_VIEW_PRIVATE (object);
   WebKitWebView *webview = WEBKIT_WEB_VIEW (object);
   WebKitUserContentManager *content_manager;
-  WebKitSecurityManager *security_manager;
-  WebKitWebContext *context;
   WebKitUserScript *script;
   GBytes *script_source;
 
@@ -466,14 +895,10 @@ maxwell_web_view_constructed (GObject *object)
                 "enable-write-console-messages-to-stdout", TRUE,
                 NULL);
 
-  /* Install custom URI scheme to inject image buffers */
-  context = webkit_web_view_get_context (webview);
-  security_manager = webkit_web_context_get_security_manager (context);
-  webkit_security_manager_register_uri_scheme_as_cors_enabled (security_manager,
-                                                               "maxwell");
-  webkit_web_context_register_uri_scheme (context, "maxwell",
-                                          on_maxwell_uri_scheme_request,
-                                          NULL, NULL);
+  /* Custom URI scheme to inject image buffers is shared by the whole context */
+  priv->broker = _maxwell_broker_get_for_context (webkit_web_view_get_context (webview));
+  priv->view_id = _maxwell_broker_register_view (priv->broker, MAXWELL_WEB_VIEW (webview));
+  _maxwell_trace_hold ();
 
   /* Add script */
   content_manager = webkit_web_view_get_user_content_manager (webview);
@@ -486,14 +911,29 @@ maxwell_web_view_constructed (GObject *object)
                                    NULL, NULL);
   webkit_user_content_manager_add_script (content_manager, script);
 
+  /* Support script is running */
+  EWV_DEFINE_MSG_HANDLER (content_manager, ready, webview);
+
   /* Init canvas elements added to the DOM */
   EWV_DEFINE_MSG_HANDLER (content_manager, children_init, webview);
 
+  /* Release canvas elements removed from the DOM */
+  EWV_DEFINE_MSG_HANDLER (content_manager, children_remove, webview);
+
   /* Handle children position changes */
   EWV_DEFINE_MSG_HANDLER (content_manager, children_move_resize, webview);
 
-  webkit_user_script_unref (script);
-  g_bytes_unref (script_source);
+  /* Document visibility changes */
+  EWV_DEFINE_MSG_HANDLER (content_manager, visibility, webview);
+
+  /* Frame cache slots the page could not fill */
+  EWV_DEFINE_MSG_HANDLER (content_manager, frame_cache_failed, webview);
+
+  /* Canvases that lost their contents */
+  EWV_DEFINE_MSG_HANDLER (content_manager, children_repaint, webview);
+
+  webkit_user_script_unref (script);
+  g_bytes_unref (script_source);
 }
 
 static void
@@ -558,9 +998,14 @@ pick_offscreen_child (GdkWindow      *offscreen_window,
 
       if (widget_x >= alloc->x && widget_x <= alloc->x + alloc->width &&
           widget_y >= alloc->y && widget_y <= alloc->y + alloc->height)
-        return data->offscreen;
+        {
+          /* Remember it to prioritize its updates */
+          priv->hover = data;
+          return data->offscreen;
+        }
     }
 
+  priv->hover = NULL;
   return NULL;
 }
 
@@ -605,11 +1050,141 @@ ensure_offscreen (GtkWidget *webview, ChildData *data)
 
   gdk_window_show (data->offscreen);
 
+  child_track_scrolling (data->child, NULL);
+
   if (realized)
     gtk_widget_realize (data->child);
 
   if (mapped)
     gtk_widget_map (data->child);
+
+  /* Let GTK map it again, it will draw and send a full frame */
+  if (data->released)
+    {
+      data->released = FALSE;
+      gtk_widget_set_child_visible (data->child, TRUE);
+    }
+}
+
+/* Offscreen window backing store size in bytes */
+static gsize
+child_offscreen_size (ChildData *data)
+{
+  gint scale;
+
+  if (!data->offscreen)
+    return 0;
+
+  scale = gdk_window_get_scale_factor (data->offscreen);
+
+  return (gsize) data->alloc.width * data->alloc.height * 4 * scale * scale;
+}
+
+static void
+child_release_offscreen (MaxwellWebView *webview, ChildData *data)
+{
+  GtkWidget *widget = GTK_WIDGET (webview);
+
+  /* Make sure GTK does not map it on our own window while released */
+  gtk_widget_set_child_visible (data->child, FALSE);
+
+  if (gtk_widget_get_realized (data->child))
+    gtk_widget_unrealize (data->child);
+
+  gtk_widget_set_parent_window (data->child, NULL);
+
+  if (data->offscreen)
+    {
+      gtk_widget_unregister_window (widget, data->offscreen);
+      g_clear_pointer (&data->offscreen, gdk_window_destroy);
+    }
+
+  /* Recreating the offscreen repaints everything */
+  g_clear_pointer (&data->pending, cairo_region_destroy);
+  g_clear_pointer (&data->scheduled, cairo_region_destroy);
+  child_release_prerender (webview, data);
+  child_scroll_reset (data);
+
+  data->released = TRUE;
+}
+
+static gint
+compare_last_visible (gconstpointer a, gconstpointer b)
+{
+  const ChildData *da = a, *db = b;
+
+  return (da->last_visible > db->last_visible) - (da->last_visible < db->last_visible);
+}
+
+/*
+ * Release offscreen windows of the least recently visible hidden children
+ * until we are within the memory budget. Visible children are never
+ * released, even if they alone exceed it.
+ */
+static void
+children_reclaim (MaxwellWebView *webview)
+{
+  MaxwellWebViewPrivate *priv = MAXWELL_WEB_VIEW_PRIVATE (webview);
+  GList *candidates = NULL, *l;
+  guint64 total = 0;
+
+  if (!priv->memory_budget)
+    return;
+
+  for (l = priv->children; l; l = g_list_next (l))
+    {
+      ChildData *data = l->data;
+
+      total += child_offscreen_size (data);
+
+      if (data->offscreen && child_is_hidden (data))
+        candidates = g_list_prepend (candidates, data);
+    }
+
+  if (total <= priv->memory_budget)
+    {
+      g_list_free (candidates);
+      return;
+    }
+
+  candidates = g_list_sort (candidates, compare_last_visible);
+
+  for (l = candidates; l && total > priv->memory_budget; l = g_list_next (l))
+    {
+      ChildData *data = l->data;
+
+      g_debug ("%s: released offscreen, not visible for %" G_GINT64_FORMAT "ms",
+               gtk_widget_get_name (data->child),
+               (g_get_monotonic_time () - data->last_visible) / 1000);
+
+      total -= child_offscreen_size (data);
+      child_release_offscreen (webview, data);
+    }
+
+  g_list_free (candidates);
+}
+
+/*
+ * Children only have an offscreen window, and get rendered, while the
+ * document has a canvas for them.
+ */
+static void
+child_update_detached (MaxwellWebView *webview, ChildData *data)
+{
+  MaxwellWebViewPrivate *priv = MAXWELL_WEB_VIEW_PRIVATE (webview);
+  const gchar *id = gtk_widget_get_name (data->child);
+
+  data->detached = !id || !g_hash_table_contains (priv->canvases, id);
+
+  if (data->detached)
+    {
+      if (!data->released)
+        child_release_offscreen (webview, data);
+
+      data->visible_set = FALSE;
+    }
+  else if (gtk_widget_get_realized (GTK_WIDGET (webview)))
+    ensure_offscreen (GTK_WIDGET (webview), data);
 }
 
 static void
@@ -627,14 +1202,18 @@ maxwell_web_view_realize (GtkWidget *widget)
                            widget,
                            0);
 
-  if (priv->cancellable)
+  if (priv->cancellable && !priv->freeze_count)
     script = g_string_new ("");
 
   for (l = priv->children; l; l = g_list_next (l))
     {
       ChildData *data = l->data;
 
-      ensure_offscreen (widget, data);
+      if (!data->detached)
+        ensure_offscreen (widget, data);
+
+      if (priv->freeze_count)
+        data->thaw_visible = TRUE;
 
       if (script)
         g_string_append_printf (script, "maxwell.child_set_visible ('%s', %s);\n",
@@ -645,29 +1224,854 @@ maxwell_web_view_realize (GtkWidget *widget)
 
   if (script)
     {
-      js_run_string (widget, priv->cancellable, script);
+      js_run_string (widget, priv->view_id, priv->cancellable, script);
       g_string_free (script, TRUE);
     }
 }
 
 static void
-maxwell_web_view_unrealize (GtkWidget *widget)
+maxwell_web_view_map (GtkWidget *widget)
+{
+  GTK_WIDGET_CLASS (maxwell_web_view_parent_class)->map (widget);
+
+  webview_set_suspended (MAXWELL_WEB_VIEW (widget), SUSPEND_UNMAPPED, FALSE);
+}
+
+static void
+maxwell_web_view_unmap (GtkWidget *widget)
+{
+  webview_set_suspended (MAXWELL_WEB_VIEW (widget), SUSPEND_UNMAPPED, TRUE);
+
+  GTK_WIDGET_CLASS (maxwell_web_view_parent_class)->unmap (widget);
+}
+
+static gboolean
+on_toplevel_window_state_event (GtkWidget           *toplevel,
+                                GdkEventWindowState *event,
+                                MaxwellWebView      *webview)
+{
+  if (event->changed_mask & GDK_WINDOW_STATE_ICONIFIED)
+    webview_set_suspended (webview, SUSPEND_ICONIFIED,
+                           event->new_window_state & GDK_WINDOW_STATE_ICONIFIED);
+
+  return FALSE;
+}
+
+static void
+maxwell_web_view_hierarchy_changed (GtkWidget *widget, GtkWidget *previous_toplevel)
+{
+  GtkWidget *toplevel = gtk_widget_get_toplevel (widget);
+
+  if (GTK_WIDGET_CLASS (maxwell_web_view_parent_class)->hierarchy_changed)
+    GTK_WIDGET_CLASS (maxwell_web_view_parent_class)->hierarchy_changed (widget, previous_toplevel);
+
+  if (previous_toplevel)
+    g_signal_handlers_disconnect_by_func (previous_toplevel,
+                                          on_toplevel_window_state_event,
+                                          widget);
+
+  if (!gtk_widget_is_toplevel (toplevel) || toplevel == widget)
+    {
+      webview_set_suspended (MAXWELL_WEB_VIEW (widget), SUSPEND_ICONIFIED, FALSE);
+      return;
+    }
+
+  g_signal_connect_object (toplevel, "window-state-event",
+                           G_CALLBACK (on_toplevel_window_state_event),
+                           widget, 0);
+
+  /* We could be moved into a window that is already minimized, one without
+   * a GdkWindow yet gets a window-state-event when it is mapped
+   */
+  webview_set_suspended (MAXWELL_WEB_VIEW (widget), SUSPEND_ICONIFIED,
+                         gtk_widget_get_realized (toplevel) &&
+                         (gdk_window_get_state (gtk_widget_get_window (toplevel)) &
+                          GDK_WINDOW_STATE_ICONIFIED));
+}
+
+static void
+maxwell_web_view_unrealize (GtkWidget *widget)
+{
+  MaxwellWebViewPrivate *priv = MAXWELL_WEB_VIEW_PRIVATE (widget);
+  GList *l;
+
+  for (l = priv->children; l; l = g_list_next (l))
+    {
+      ChildData *data = l->data;
+
+      if (!data->offscreen)
+        continue;
+
+      gtk_widget_unregister_window (widget, data->offscreen);
+      g_clear_pointer (&data->offscreen, gdk_window_destroy);
+    }
+
+  GTK_WIDGET_CLASS (maxwell_web_view_parent_class)->unrealize (widget);
+}
+
+/*
+ * Copy @area of the child offscreen window into an image surface from the
+ * broker pool.
+ *
+ * This is the only part of a frame done on the main thread, the broker
+ * converts the pixels in a worker thread.
+ */
+static cairo_surface_t *
+child_capture (MaxwellWebView *webview, ChildData *data, GdkRectangle *area)
+{
+  MaxwellWebViewPrivate *priv = MAXWELL_WEB_VIEW_PRIVATE (webview);
+  cairo_surface_t *surface = gdk_offscreen_window_get_surface (data->offscreen);
+  gint scale = gdk_window_get_scale_factor (data->offscreen);
+  cairo_surface_t *image;
+  cairo_t *cr;
+
+  if (!surface)
+    return NULL;
+
+  /* Keep the backing store resolution on HiDPI */
+  image = _maxwell_broker_get_surface (priv->broker,
+                                       area->width * scale,
+                                       area->height * scale);
+  cairo_surface_set_device_scale (image, scale, scale);
+
+  cr = cairo_create (image);
+  cairo_set_operator (cr, CAIRO_OPERATOR_SOURCE);
+  cairo_set_source_surface (cr, surface, -area->x, -area->y);
+  cairo_paint (cr);
+  cairo_destroy (cr);
+
+  return image;
+}
+
+/* Visible area of the child rounded up to whole tiles */
+static void
+child_get_visible_tiles (ChildData *data, GdkRectangle *tiles)
+{
+  gint x2, y2;
+
+  tiles->x = tiles->y = 0;
+
+  /* Everything is visible until the DOM tells us otherwise */
+  if (!data->visible_set)
+    {
+      tiles->width = data->alloc.width;
+      tiles->height = data->alloc.height;
+      return;
+    }
+
+  if (data->visible.width <= 0 || data->visible.height <= 0)
+    {
+      tiles->width = tiles->height = 0;
+      return;
+    }
+
+  x2 = data->visible.x + data->visible.width + TILE_SIZE - 1;
+  y2 = data->visible.y + data->visible.height + TILE_SIZE - 1;
+
+  tiles->x = MAX (0, data->visible.x) / TILE_SIZE * TILE_SIZE;
+  tiles->y = MAX (0, data->visible.y) / TILE_SIZE * TILE_SIZE;
+  tiles->width = MIN (x2 / TILE_SIZE * TILE_SIZE, data->alloc.width) - tiles->x;
+  tiles->height = MIN (y2 / TILE_SIZE * TILE_SIZE, data->alloc.height) - tiles->y;
+}
+
+/*
+ * Returns the frame cache slot holding @image or 0 if the web process does
+ * not have it, in which case @store_slot is set to the least recently used
+ * slot, which is assumed to hold @image from now on.
+ */
+static guint
+frame_cache_lookup (MaxwellWebViewPrivate *priv,
+                    cairo_surface_t       *image,
+                    guint                 *store_slot)
+{
+  guint64 hash = _maxwell_frame_hash (image);
+  gint width = cairo_image_surface_get_width (image);
+  gint height = cairo_image_surface_get_height (image);
+  guint i, lru = 0;
+
+  priv->frame_cache_clock++;
+
+  for (i = 0; i < FRAME_CACHE_SLOTS; i++)
+    {
+      /* A hash collision between different sizes would paint garbage */
+      if (priv->frame_cache[i].last_used &&
+          priv->frame_cache[i].hash == hash &&
+          priv->frame_cache[i].width == width &&
+          priv->frame_cache[i].height == height)
+        {
+          priv->frame_cache[i].last_used = priv->frame_cache_clock;
+          return i + 1;
+        }
+
+      if (priv->frame_cache[i].last_used < priv->frame_cache[lru].last_used)
+        lru = i;
+    }
+
+  priv->frame_cache[lru].hash = hash;
+  priv->frame_cache[lru].width = width;
+  priv->frame_cache[lru].height = height;
+  priv->frame_cache[lru].last_used = priv->frame_cache_clock;
+  *store_slot = lru + 1;
+
+  return 0;
+}
+
+/* Runs a child command now or adds it to the thaw batch */
+static void
+child_run_script (MaxwellWebView *webview, ChildData *data, gchar *script)
+{
+  MaxwellWebViewPrivate *priv = MAXWELL_WEB_VIEW_PRIVATE (webview);
+
+  if (priv->batch)
+    {
+      g_string_append (priv->batch, script);
+      g_string_append_c (priv->batch, '\n');
+    }
+  else
+    js_run_printf (webview, priv->view_id, data->cancellable, "%s", script);
+
+  g_free (script);
+}
+
+static void
+child_send_area (MaxwellWebView *webview, ChildData *data, GdkRectangle *area)
+{
+  MaxwellWebViewPrivate *priv = MAXWELL_WEB_VIEW_PRIVATE (webview);
+  cairo_surface_t *image;
+  guint id, slot, store_slot = 0;
+  gboolean streamed;
+  gsize size;
+
+  if (area->width <= 0 || area->height <= 0)
+    return;
+
+  if (!(image = child_capture (webview, data, area)))
+    return;
+
+  _maxwell_trace_frame (priv->view_id, gtk_widget_get_name (data->child), area, image);
+
+  size = (gsize) cairo_image_surface_get_stride (image) *
+         cairo_image_surface_get_height (image);
+
+  /* Repeated content, like rows of identical buttons, costs no transfer */
+  if (size <= FRAME_CACHE_MAX_SIZE &&
+      (slot = frame_cache_lookup (priv, image, &store_slot)))
+    {
+      child_run_script (webview, data,
+                        g_strdup_printf ("maxwell.child_draw_cached ('%s', %u, %d, %d, %d, %d);",
+                                         gtk_widget_get_name (data->child), slot,
+                                         area->x, area->y, area->width, area->height));
+
+      priv->stats.cache_hits++;
+      cairo_surface_destroy (image);
+      return;
+    }
+
+  /* Small frames, like a blinking cursor, cost less as base64 than a
+   * maxwell:// round trip
+   */
+  if (size <= priv->inline_threshold)
+    {
+      GBytes *bytes = _maxwell_frame_from_surface (image);
+      gchar *pixels = g_base64_encode (g_bytes_get_data (bytes, NULL),
+                                       g_bytes_get_size (bytes));
+
+      child_run_script (webview, data,
+                        g_strdup_printf ("maxwell.child_draw_inline ('%s', '%s', %d, %d, %d, %d, %u);",
+                                         gtk_widget_get_name (data->child),
+                                         pixels,
+                                         area->x, area->y, area->width, area->height,
+                                         store_slot));
+
+      priv->stats.frames++;
+      priv->stats.inlined++;
+      priv->stats.bytes += g_bytes_get_size (bytes);
+
+      g_free (pixels);
+      g_bytes_unref (bytes);
+      cairo_surface_destroy (image);
+      return;
+    }
+
+  if ((id = _maxwell_broker_push_frame (priv->broker, priv->view_id, image,
+                                        &streamed)))
+    {
+      if (streamed)
+        child_run_script (webview, data,
+                          g_strdup_printf ("maxwell.child_draw_streamed ('%s', %u, %d, %d, %d, %d, %u);",
+                                           gtk_widget_get_name (data->child), id,
+                                           area->x, area->y, area->width, area->height,
+                                           store_slot));
+      else
+        child_run_script (webview, data,
+                          g_strdup_printf ("maxwell.child_draw ('%s', '%u/%u', %d, %d, %d, %d, %u);",
+                                           gtk_widget_get_name (data->child),
+                                           priv->view_id, id,
+                                           area->x, area->y, area->width, area->height,
+                                           store_slot));
+
+      priv->stats.frames++;
+      priv->stats.bytes += size;
+    }
+  else if (store_slot)
+    {
+      /* The web process will never get it */
+      priv->frame_cache[store_slot - 1].last_used = 0;
+    }
+}
+
+/*
+ * Send @region either as one frame per rectangle or as a single frame of its
+ * bounding box, whatever costs less.
+ *
+ * Small spots far apart are cheaper to send separately while many
+ * rectangles close together (like text lines) are better merged.
+ */
+static void
+child_send_region (MaxwellWebView *webview, ChildData *data, cairo_region_t *region)
+{
+  MaxwellWebViewPrivate *priv = MAXWELL_WEB_VIEW_PRIVATE (webview);
+  cairo_rectangle_int_t extents, rect;
+  gint64 split_cost = 0, union_cost;
+  gint i, n;
+
+  if (!(n = cairo_region_num_rectangles (region)))
+    return;
+
+  cairo_region_get_extents (region, &extents);
+  union_cost = FRAME_REQUEST_COST + (gint64) extents.width * extents.height * 4;
+
+  for (i = 0; i < n && split_cost < union_cost; i++)
+    {
+      cairo_region_get_rectangle (region, i, &rect);
+      split_cost += FRAME_REQUEST_COST + (gint64) rect.width * rect.height * 4;
+    }
+
+  if (n > 1 && split_cost < union_cost)
+    {
+      g_debug ("%s: split %d rectangles, %" G_GINT64_FORMAT " < %" G_GINT64_FORMAT,
+               gtk_widget_get_name (data->child), n, split_cost, union_cost);
+
+      priv->stats.damage_split++;
+
+      for (i = 0; i < n; i++)
+        {
+          cairo_region_get_rectangle (region, i, &rect);
+          child_send_area (webview, data, &rect);
+        }
+    }
+  else
+    {
+      if (n > 1)
+        {
+          g_debug ("%s: merged %d rectangles, %" G_GINT64_FORMAT " >= %" G_GINT64_FORMAT,
+                   gtk_widget_get_name (data->child), n, split_cost, union_cost);
+
+          priv->stats.damage_union++;
+        }
+      else
+        priv->stats.damage_single++;
+
+      child_send_area (webview, data, &extents);
+    }
+}
+
+static void
+child_scroll_reset (ChildData *data)
+{
+  if (data->scrolled)
+    g_object_remove_weak_pointer (G_OBJECT (data->scrolled),
+                                  (gpointer *) &data->scrolled);
+
+  data->scrolled = NULL;
+  data->scroll_dx = data->scroll_dy = 0;
+  data->scroll_mixed = FALSE;
+}
+
+/* Gets the part of @scrolled that moves with its adjustments, in @data child coordinates */
+static gboolean
+child_get_scroll_view (ChildData         *data,
+                       GtkScrolledWindow *scrolled,
+                       GdkRectangle      *view)
+{
+  GtkWidget *scrollable;
+
+  if (!(scrollable = gtk_bin_get_child (GTK_BIN (scrolled))) ||
+      !gtk_widget_translate_coordinates (scrollable, data->child, 0, 0,
+                                         &view->x, &view->y))
+    return FALSE;
+
+  view->width = gtk_widget_get_allocated_width (scrollable);
+  view->height = gtk_widget_get_allocated_height (scrollable);
+
+  /* Tree view headers do not scroll */
+  if (GTK_IS_TREE_VIEW (scrollable))
+    {
+      gint bx, by;
+
+      gtk_tree_view_convert_bin_window_to_widget_coords (GTK_TREE_VIEW (scrollable),
+                                                         0, 0, &bx, &by);
+      view->y += by;
+      view->height -= by;
+    }
+
+  return TRUE;
+}
+
+static void
+on_scroll_adjustment_value_changed (GtkAdjustment *adjustment,
+                                    GtkWidget     *scrolled)
+{
+  gdouble *last = g_object_get_data (G_OBJECT (adjustment), SCROLL_VALUE_KEY);
+  gdouble value = gtk_adjustment_get_value (adjustment);
+  GtkWidget *webview, *child;
+  ChildData *data;
+  gint delta;
+
+  /* Contents are offset by the value truncated to an int */
+  delta = (gint) value - (gint) *last;
+  *last = value;
+
+  if (!delta || !(webview = gtk_widget_get_ancestor (scrolled, MAXWELL_TYPE_WEB_VIEW)))
+    return;
+
+  for (child = scrolled; gtk_widget_get_parent (child) != webview;)
+    child = gtk_widget_get_parent (child);
+
+  if (!(data = get_child_data_by_child (MAXWELL_WEB_VIEW_PRIVATE (webview), child)))
+    return;
+
+  if (data->scrolled && data->scrolled != scrolled)
+    data->scroll_mixed = TRUE;
+
+  if (!data->scrolled)
+    {
+      GdkRectangle view;
+
+      /* Damage still waiting for a flush was drawn before the scroll, the
+       * canvas will not have it where the page would copy from
+       */
+      if (data->scheduled &&
+          (!child_get_scroll_view (data, GTK_SCROLLED_WINDOW (scrolled), &view) ||
+           cairo_region_contains_rectangle (data->scheduled, &view) != CAIRO_REGION_OVERLAP_OUT))
+        data->scroll_mixed = TRUE;
+
+      data->scrolled = scrolled;
+      g_object_add_weak_pointer (G_OBJECT (scrolled), (gpointer *) &data->scrolled);
+    }
+
+  if (adjustment == gtk_scrolled_window_get_hadjustment (GTK_SCROLLED_WINDOW (scrolled)))
+    data->scroll_dx += delta;
+  else
+    data->scroll_dy += delta;
+}
+
+static void
+scroll_adjustment_track (GtkAdjustment *adjustment, GtkWidget *scrolled)
+{
+  gdouble value = gtk_adjustment_get_value (adjustment);
+
+  g_object_set_data_full (G_OBJECT (adjustment), SCROLL_VALUE_KEY,
+                          g_memdup (&value, sizeof (value)), g_free);
+  g_signal_connect_object (adjustment, "value-changed",
+                           G_CALLBACK (on_scroll_adjustment_value_changed),
+                           scrolled, 0);
+}
+
+/*
+ * Watch every GtkScrolledWindow in @widget, called when a child is added
+ * and when its offscreen window is created so scrolled windows added later
+ * are eventually tracked too.
+ */
+static void
+child_track_scrolling (GtkWidget *widget, gpointer user_data)
+{
+  if (GTK_IS_SCROLLED_WINDOW (widget) &&
+      !g_object_get_data (G_OBJECT (widget), SCROLL_TRACKED_KEY))
+    {
+      GtkScrolledWindow *scrolled = GTK_SCROLLED_WINDOW (widget);
+
+      g_object_set_data (G_OBJECT (widget), SCROLL_TRACKED_KEY, GINT_TO_POINTER (TRUE));
+      scroll_adjustment_track (gtk_scrolled_window_get_hadjustment (scrolled), widget);
+      scroll_adjustment_track (gtk_scrolled_window_get_vadjustment (scrolled), widget);
+    }
+
+  if (GTK_IS_CONTAINER (widget))
+    gtk_container_forall (GTK_CONTAINER (widget), child_track_scrolling, NULL);
+}
+
+/* Removes @widget area, and where the copy would move it, from @region */
+static void
+region_subtract_widget (cairo_region_t *region,
+                        GtkWidget      *widget,
+                        GtkWidget      *child,
+                        gint            dx,
+                        gint            dy)
+{
+  GdkRectangle rect;
+
+  if (!gtk_widget_get_mapped (widget) ||
+      !gtk_widget_translate_coordinates (widget, child, 0, 0, &rect.x, &rect.y))
+    return;
+
+  rect.width = gtk_widget_get_allocated_width (widget);
+  rect.height = gtk_widget_get_allocated_height (widget);
+  cairo_region_subtract_rectangle (region, &rect);
+
+  rect.x -= dx;
+  rect.y -= dy;
+  cairo_region_subtract_rectangle (region, &rect);
+}
+
+/*
+ * When a GtkScrolledWindow scrolled and GTK repainted its whole viewport, the
+ * page moves what is already in the canvas and only the exposed strip has to
+ * be sent, like gdk_window_scroll() used to do.
+ *
+ * Returns the part of @damage left to send, or NULL to send all of it.
+ */
+static cairo_region_t *
+child_send_scroll (MaxwellWebView *webview, ChildData *data, const cairo_region_t *damage)
+{
+  MaxwellWebViewPrivate *priv = MAXWELL_WEB_VIEW_PRIVATE (webview);
+  GtkScrolledWindow *scrolled;
+  GdkRectangle view, shifted, copy, tiles;
+  cairo_region_t *moved, *remaining;
+  gint dx = data->scroll_dx, dy = data->scroll_dy;
+
+  if (!data->scrolled)
+    return NULL;
+
+  scrolled = GTK_SCROLLED_WINDOW (data->scrolled);
+
+  if (data->scroll_mixed || (!dx && !dy) ||
+      !child_get_scroll_view (data, scrolled, &view))
+    {
+      child_scroll_reset (data);
+      return NULL;
+    }
+
+  /* Wait for GTK to repaint the scrolled contents, anything else drawn in
+   * the viewport meanwhile means this was not a plain scroll
+   */
+  switch (cairo_region_contains_rectangle (damage, &view))
+    {
+    case CAIRO_REGION_OVERLAP_OUT:
+      return NULL;
+    case CAIRO_REGION_OVERLAP_PART:
+      child_scroll_reset (data);
+      return NULL;
+    case CAIRO_REGION_OVERLAP_IN:
+      child_scroll_reset (data);
+      break;
+    }
+
+  /* Contents move the opposite way of the adjustments */
+  shifted = view;
+  shifted.x -= dx;
+  shifted.y -= dy;
+
+  if (!gdk_rectangle_intersect (&view, &shifted, &copy))
+    return NULL;
+
+  /* Canvas has to be up to date where we copy from */
+  child_get_visible_tiles (data, &tiles);
+
+  if (!gdk_rectangle_intersect (&view, &tiles, &shifted) ||
+      shifted.width != view.width || shifted.height != view.height ||
+      (data->pending &&
+       cairo_region_contains_rectangle (data->pending, &view) != CAIRO_REGION_OVERLAP_OUT))
+    return NULL;
+
+  /* Overlay scrollbars do not move with the contents */
+  moved = cairo_region_create_rectangle (&copy);
+  region_subtract_widget (moved, gtk_scrolled_window_get_hscrollbar (scrolled),
+                          data->child, dx, dy);
+  region_subtract_widget (moved, gtk_scrolled_window_get_vscrollbar (scrolled),
+                          data->child, dx, dy);
+
+  child_run_script (webview, data,
+                    g_strdup_printf ("maxwell.child_scroll ('%s', %d, %d, %d, %d, %d, %d);",
+                                     gtk_widget_get_name (data->child),
+                                     copy.x + dx, copy.y + dy,
+                                     copy.width, copy.height, -dx, -dy));
+  priv->stats.scrolls++;
+
+  remaining = cairo_region_copy (damage);
+  cairo_region_subtract (remaining, moved);
+  cairo_region_destroy (moved);
+
+  return remaining;
+}
+
+/*
+ * Send the visible part of @damage right away and keep the rest in
+ * data->pending until it scrolls into view.
+ */
+static void
+child_damage (MaxwellWebView *webview, ChildData *data, const cairo_region_t *damage)
+{
+  cairo_region_t *visible, *hidden, *remaining;
+  GdkRectangle tiles;
+
+  /* Only what scrolling exposed is left */
+  if ((remaining = child_send_scroll (webview, data, damage)))
+    damage = remaining;
+
+  child_get_visible_tiles (data, &tiles);
+
+  visible = cairo_region_copy (damage);
+  cairo_region_intersect_rectangle (visible, &tiles);
+  child_send_region (webview, data, visible);
+  cairo_region_destroy (visible);
+
+  hidden = cairo_region_copy (damage);
+  cairo_region_subtract_rectangle (hidden, &tiles);
+  g_clear_pointer (&remaining, cairo_region_destroy);
+
+  if (cairo_region_is_empty (hidden))
+    {
+      cairo_region_destroy (hidden);
+      return;
+    }
+
+  if (data->pending)
+    {
+      cairo_region_union (data->pending, hidden);
+      cairo_region_destroy (hidden);
+    }
+  else
+    data->pending = hidden;
+
+  child_queue_prerender (webview, data);
+}
+
+static gboolean
+child_send_pending (MaxwellWebView *webview)
+{
+  MaxwellWebViewPrivate *priv = MAXWELL_WEB_VIEW_PRIVATE (webview);
+  GList *l;
+
+  priv->pending_id = 0;
+
+  if (!priv->cancellable || priv->freeze_count)
+    return G_SOURCE_REMOVE;
+
+  for (l = priv->children; l; l = g_list_next (l))
+    {
+      ChildData *data = l->data;
+      cairo_region_t *visible;
+      GdkRectangle tiles;
+
+      if (!data->pending || !data->offscreen ||
+          !gtk_widget_get_visible (data->child))
+        continue;
+
+      child_get_visible_tiles (data, &tiles);
+
+      visible = cairo_region_copy (data->pending);
+      cairo_region_intersect_rectangle (visible, &tiles);
+      cairo_region_subtract_rectangle (data->pending, &tiles);
+
+      child_send_region (webview, data, visible);
+      cairo_region_destroy (visible);
+
+      if (cairo_region_is_empty (data->pending))
+        g_clear_pointer (&data->pending, cairo_region_destroy);
+    }
+
+  return G_SOURCE_REMOVE;
+}
+
+/*
+ * Render pending damage of hidden children in the background so showing
+ * them presents a ready frame instead of waiting for a whole round trip.
+ *
+ * One child per iteration to keep the main loop responsive.
+ */
+static gboolean
+child_prerender (MaxwellWebView *webview)
+{
+  MaxwellWebViewPrivate *priv = MAXWELL_WEB_VIEW_PRIVATE (webview);
+  GList *l;
+
+  if (!priv->cancellable || priv->freeze_count)
+    {
+      priv->prerender_id = 0;
+      return G_SOURCE_REMOVE;
+    }
+
+  for (l = priv->children; l; l = g_list_next (l))
+    {
+      ChildData *data = l->data;
+      gsize bytes;
+
+      if (!data->pending || !data->offscreen || !child_is_hidden (data) ||
+          !gtk_widget_get_visible (data->child))
+        continue;
+
+      /* Already staged children only need their new damage */
+      bytes = (gsize) data->alloc.width * data->alloc.height * 4;
+      if (priv->prerender_bytes - data->prerender_bytes + bytes > PRERENDER_MEMORY_CAP)
+        continue;
+
+      priv->prerender_bytes += bytes - data->prerender_bytes;
+      data->prerender_bytes = bytes;
+      priv->stats.prerendered++;
+
+      child_send_region (webview, data, data->pending);
+      g_clear_pointer (&data->pending, cairo_region_destroy);
+
+      return G_SOURCE_CONTINUE;
+    }
+
+  priv->prerender_id = 0;
+  return G_SOURCE_REMOVE;
+}
+
+static void
+child_queue_prerender (MaxwellWebView *webview, ChildData *data)
+{
+  MaxwellWebViewPrivate *priv = MAXWELL_WEB_VIEW_PRIVATE (webview);
+
+  if (priv->prerender_id || !data->pending || !child_is_hidden (data))
+    return;
+
+  priv->prerender_id = g_idle_add_full (G_PRIORITY_LOW,
+                                        (GSourceFunc) child_prerender,
+                                        webview, NULL);
+}
+
+static void
+child_release_prerender (MaxwellWebView *webview, ChildData *data)
+{
+  MaxwellWebViewPrivate *priv = MAXWELL_WEB_VIEW_PRIVATE (webview);
+
+  priv->prerender_bytes -= data->prerender_bytes;
+  data->prerender_bytes = 0;
+}
+
+/* Whether the user is interacting with the child */
+static gboolean
+child_is_interactive (MaxwellWebView *webview, ChildData *data)
+{
+  MaxwellWebViewPrivate *priv = MAXWELL_WEB_VIEW_PRIVATE (webview);
+  GtkWidget *grab;
+
+  if (data == priv->hover ||
+      data->child == gtk_container_get_focus_child (GTK_CONTAINER (webview)))
+    return TRUE;
+
+  grab = gtk_grab_get_current ();
+
+  return grab && (grab == data->child || gtk_widget_is_ancestor (grab, data->child));
+}
+
+/* Sends @data scheduled damage, unless its max-fps does not allow it yet */
+static gboolean
+child_flush (MaxwellWebView *webview, ChildData *data, gint64 now)
+{
+  if (now < data->next_frame)
+    return FALSE;
+
+  if (data->offscreen && gtk_widget_get_visible (data->child))
+    child_damage (webview, data, data->scheduled);
+
+  g_clear_pointer (&data->scheduled, cairo_region_destroy);
+  data->update_requested = FALSE;
+
+  if (data->max_fps)
+    data->next_frame = now + G_USEC_PER_SEC / data->max_fps;
+
+  return TRUE;
+}
+
+static gboolean
+children_flush_scheduled (MaxwellWebView *webview)
+{
+  MaxwellWebViewPrivate *priv = MAXWELL_WEB_VIEW_PRIVATE (webview);
+  gint64 now = g_get_monotonic_time ();
+  gint64 next = G_MAXINT64;
+  GList *l;
+
+  priv->flush_id = 0;
+
+  if (!priv->cancellable || priv->freeze_count)
+    return G_SOURCE_REMOVE;
+
+  for (l = priv->children; l; l = g_list_next (l))
+    {
+      ChildData *data = l->data;
+
+      if (!data->scheduled)
+        continue;
+
+      /* Held until maxwell_web_view_update_child() */
+      if (data->update_mode == MAXWELL_UPDATE_MODE_ON_DEMAND &&
+          !data->update_requested)
+        continue;
+
+      if (!child_flush (webview, data, now))
+        next = MIN (next, data->next_frame);
+    }
+
+  /* Come back for children over their frame rate */
+  if (next != G_MAXINT64)
+    priv->flush_id = g_timeout_add (MAX (1, (next - now) / 1000),
+                                    (GSourceFunc) children_flush_scheduled,
+                                    webview);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+children_queue_flush (MaxwellWebView *webview)
 {
-  MaxwellWebViewPrivate *priv = MAXWELL_WEB_VIEW_PRIVATE (widget);
-  GList *l;
+  MaxwellWebViewPrivate *priv = MAXWELL_WEB_VIEW_PRIVATE (webview);
 
-  for (l = priv->children; l; l = g_list_next (l))
+  if (!priv->flush_id && !priv->freeze_count)
+    priv->flush_id = g_timeout_add (BACKGROUND_FRAME_INTERVAL,
+                                    (GSourceFunc) children_flush_scheduled,
+                                    webview);
+}
+
+/*
+ * Children the user interacts with get their damage sent right away, the
+ * rest is batched and sent at most every BACKGROUND_FRAME_INTERVAL so busy
+ * animations do not delay input feedback.
+ *
+ * Child properties can hold or drop damage and limit the frame rate.
+ */
+static void
+child_schedule_damage (MaxwellWebView       *webview,
+                       ChildData            *data,
+                       const cairo_region_t *damage)
+{
+  MaxwellWebViewPrivate *priv = MAXWELL_WEB_VIEW_PRIVATE (webview);
+
+  /* Keep showing the last frame */
+  if (data->update_mode == MAXWELL_UPDATE_MODE_SNAPSHOT)
     {
-      ChildData *data = l->data;
+      child_scroll_reset (data);
+      return;
+    }
 
-      if (!data->offscreen)
-        continue;
+  if (data->scheduled)
+    cairo_region_union (data->scheduled, damage);
+  else
+    data->scheduled = cairo_region_copy (damage);
 
-      gtk_widget_unregister_window (widget, data->offscreen);
-      g_clear_pointer (&data->offscreen, gdk_window_destroy);
+  if (priv->freeze_count || data->update_mode == MAXWELL_UPDATE_MODE_ON_DEMAND)
+    return;
+
+  if (child_is_interactive (webview, data) &&
+      child_flush (webview, data, g_get_monotonic_time ()))
+    {
+      priv->stats.immediate++;
+      return;
     }
 
-  GTK_WIDGET_CLASS (maxwell_web_view_parent_class)->unrealize (widget);
+  children_queue_flush (webview);
 }
 
 static gboolean
@@ -686,48 +2090,74 @@ maxwell_web_view_damage_event (GtkWidget *widget, GdkEventExpose *event)
       gtk_widget_get_name (data->child) &&
       gtk_widget_get_visible (data->child))
     {
-      GdkPixbuf *pixbuf = gdk_pixbuf_get_from_window (data->offscreen,
-                                                      event->area.x,
-                                                      event->area.y,
-                                                      event->area.width,
-                                                      event->area.height);
-
-      /* Double check format is what JavaScript ImageData expects */
-      if (pixbuf &&
-          gdk_pixbuf_get_colorspace (pixbuf) == GDK_COLORSPACE_RGB &&
-          gdk_pixbuf_get_bits_per_sample (pixbuf) == 8 &&
-          gdk_pixbuf_get_has_alpha (pixbuf))
+      if (event->region)
+        child_schedule_damage (MAXWELL_WEB_VIEW (widget), data, event->region);
+      else
         {
-          guint id = ++priv->pixbuf_count;
-
-          g_queue_push_tail (priv->pixbufs,
-                             maxwell_web_view_pixbuf_new (pixbuf, id));
-
-          js_run_printf (widget, data->cancellable,
-                         "maxwell.child_draw ('%s', '%u', %d, %d, %d, %d);",
-                         gtk_widget_get_name (data->child),
-                         id,
-                         event->area.x,
-                         event->area.y,
-                         event->area.width,
-                         event->area.height);
+          cairo_region_t *region = cairo_region_create_rectangle (&event->area);
+          child_schedule_damage (MAXWELL_WEB_VIEW (widget), data, region);
+          cairo_region_destroy (region);
         }
     }
 
   return FALSE;
 }
 
+static gboolean
+layout_check_timeout (MaxwellWebView *webview)
+{
+  MaxwellWebViewPrivate *priv = MAXWELL_WEB_VIEW_PRIVATE (webview);
+
+  priv->layout_check_id = 0;
+  priv->layout_check_all = TRUE;
+  gtk_widget_queue_resize (GTK_WIDGET (webview));
+
+  return G_SOURCE_REMOVE;
+}
+
 static void
 maxwell_web_view_size_allocate (GtkWidget *widget, GtkAllocation *allocation)
 {
   MaxwellWebView *webview = MAXWELL_WEB_VIEW (widget);
   MaxwellWebViewPrivate *priv = MAXWELL_WEB_VIEW_PRIVATE (webview);
+  GtkAllocation old;
+  gboolean check_all;
   GList *l;
 
+  gtk_widget_get_allocation (widget, &old);
+
   GTK_WIDGET_CLASS (maxwell_web_view_parent_class)->size_allocate (widget, allocation);
 
+  /* Children size does not depend on ours, but GTK does not tell a container
+   * which child queued a resize. So if our size did not change a child must
+   * have triggered this allocation and we check them all, otherwise only the
+   * ones we know changed are measured and allocated.
+   */
+  check_all = priv->layout_check_all ||
+              (old.width == allocation->width && old.height == allocation->height);
+  priv->layout_check_all = FALSE;
+
   for (l = priv->children; l; l = g_list_next (l))
-    child_allocate (webview, l->data);
+    {
+      ChildData *data = l->data;
+
+      if (!check_all && !data->needs_allocate)
+        continue;
+
+      data->needs_allocate = FALSE;
+      child_allocate (webview, data);
+    }
+
+  /* Catch any child resize that happened during a resize storm once it ends */
+  if (!check_all)
+    {
+      if (priv->layout_check_id)
+        g_source_remove (priv->layout_check_id);
+
+      priv->layout_check_id = g_timeout_add (LAYOUT_CHECK_TIMEOUT,
+                                             (GSourceFunc) layout_check_timeout,
+                                             webview);
+    }
 }
 
 static gboolean
@@ -759,11 +2189,16 @@ maxwell_web_view_draw (GtkWidget *widget, cairo_t *cr)
             !gtk_cairo_should_draw_window (cr, data->offscreen))
           continue;
 
-        /* Clear offscreen window instead of rendering webview background */
-        cairo_save (cr);
-        cairo_set_operator (cr, CAIRO_OPERATOR_CLEAR);
-        cairo_paint (cr);
-        cairo_restore (cr);
+        /* Clear offscreen window instead of rendering webview background,
+         * not needed if the child paints every pixel
+         */
+        if (!data->opaque)
+          {
+            cairo_save (cr);
+            cairo_set_operator (cr, CAIRO_OPERATOR_CLEAR);
+            cairo_paint (cr);
+            cairo_restore (cr);
+          }
 
         gtk_container_propagate_draw (GTK_CONTAINER (widget), data->child, cr);
     }
@@ -777,18 +2212,30 @@ child_update_visibility (MaxwellWebView *webview, GtkWidget *child)
   MaxwellWebViewPrivate *priv = MAXWELL_WEB_VIEW_PRIVATE (webview);
   ChildData *data = get_child_data_by_child (priv, child);
 
-  if (priv->cancellable && data && gtk_widget_get_name (data->child))
-    js_run_printf (webview, priv->cancellable,
+  if (data && priv->freeze_count)
+    data->thaw_visible = TRUE;
+  else if (priv->cancellable && data && gtk_widget_get_name (data->child))
+    js_run_printf (webview, priv->view_id, priv->cancellable,
                    "maxwell.child_set_visible ('%s', %s);",
                    gtk_widget_get_name (data->child),
                    gtk_widget_get_visible (child) ? "true" : "false");
 }
 
+static void
+child_queue_allocate (MaxwellWebView *webview, GtkWidget *child)
+{
+  ChildData *data = get_child_data_by_child (MAXWELL_WEB_VIEW_PRIVATE (webview), child);
+
+  if (data)
+    data->needs_allocate = TRUE;
+}
+
 static void
 on_child_visible_notify (GObject        *object,
                          GParamSpec     *pspec,
                          MaxwellWebView *webview)
 {
+  child_queue_allocate (webview, GTK_WIDGET (object));
   child_update_visibility (webview, GTK_WIDGET (object));
 }
 
@@ -817,11 +2264,16 @@ on_child_name_notify (GObject        *object,
         }
     }
 
-  if (gtk_widget_get_realized (GTK_WIDGET (webview)))
-    {
-      ensure_offscreen (GTK_WIDGET (webview), data);
-      child_update_visibility (webview, data->child);
-    }
+  data->needs_allocate = TRUE;
+
+  /* Any offscreen belongs to the previous name canvas */
+  if (data->offscreen)
+    child_release_offscreen (webview, data);
+
+  child_update_detached (webview, data);
+
+  if (data->offscreen)
+    child_update_visibility (webview, data->child);
 }
 
 static void
@@ -846,6 +2298,10 @@ maxwell_web_view_add (GtkContainer *container, GtkWidget *child)
   priv->children = g_list_prepend (priv->children,
                                    maxwell_web_view_child_new (child));
 
+  /* Nothing is created until the document has a canvas for it */
+  child_update_detached (MAXWELL_WEB_VIEW (container), priv->children->data);
+  child_track_scrolling (child, NULL);
+
   gtk_widget_queue_resize (GTK_WIDGET (container));
 }
 
@@ -865,6 +2321,11 @@ maxwell_web_view_remove (GtkContainer *container, GtkWidget *child)
 
   if ((data = get_child_data_by_child (priv, child)))
     {
+      child_release_prerender (MAXWELL_WEB_VIEW (container), data);
+
+      if (priv->hover == data)
+        priv->hover = NULL;
+
       priv->children = g_list_remove (priv->children, data);
       maxwell_web_view_child_free (data);
     }
@@ -872,6 +2333,84 @@ maxwell_web_view_remove (GtkContainer *container, GtkWidget *child)
   gtk_widget_unparent (child);
 }
 
+static void
+child_set_update_mode (MaxwellWebView    *webview,
+                       ChildData         *data,
+                       MaxwellUpdateMode  mode)
+{
+  MaxwellUpdateMode old_mode = data->update_mode;
+
+  data->update_mode = mode;
+
+  /* Changes were dropped, start over with a full frame */
+  if (old_mode == MAXWELL_UPDATE_MODE_SNAPSHOT && mode != old_mode)
+    gtk_widget_queue_draw (data->child);
+
+  /* Send what was held */
+  if (mode == MAXWELL_UPDATE_MODE_CONTINUOUS && data->scheduled)
+    children_queue_flush (webview);
+}
+
+static void
+maxwell_web_view_set_child_property (GtkContainer *container,
+                                     GtkWidget    *child,
+                                     guint         property_id,
+                                     const GValue *value,
+                                     GParamSpec   *pspec)
+{
+  MaxwellWebViewPrivate *priv = MAXWELL_WEB_VIEW_PRIVATE (container);
+  ChildData *data = get_child_data_by_child (priv, child);
+
+  g_return_if_fail (data != NULL);
+
+  switch (property_id)
+    {
+    case CHILD_PROP_MAX_FPS:
+      data->max_fps = g_value_get_uint (value);
+      data->next_frame = 0;
+      break;
+    case CHILD_PROP_UPDATE_MODE:
+      child_set_update_mode (MAXWELL_WEB_VIEW (container), data,
+                             g_value_get_enum (value));
+      break;
+    case CHILD_PROP_OPAQUE:
+      data->opaque = g_value_get_boolean (value);
+      break;
+    default:
+      GTK_CONTAINER_WARN_INVALID_CHILD_PROPERTY_ID (container, property_id, pspec);
+      break;
+    }
+}
+
+static void
+maxwell_web_view_get_child_property (GtkContainer *container,
+                                     GtkWidget    *child,
+                                     guint         property_id,
+                                     GValue       *value,
+                                     GParamSpec   *pspec)
+{
+  MaxwellWebViewPrivate *priv = MAXWELL_WEB_VIEW_PRIVATE (container);
+  ChildData *data = get_child_data_by_child (priv, child);
+
+  g_return_if_fail (data != NULL);
+
+  switch (property_id)
+    {
+    case CHILD_PROP_MAX_FPS:
+      g_value_set_uint (value, data->max_fps);
+      break;
+    case CHILD_PROP_UPDATE_MODE:
+      g_value_set_enum (value, data->update_mode);
+      break;
+    case CHILD_PROP_OPAQUE:
+      g_value_set_boolean (value, data->opaque);
+      break;
+    default:
+      GTK_CONTAINER_WARN_INVALID_CHILD_PROPERTY_ID (container, property_id, pspec);
+      break;
+    }
+}
+
 static void
 maxwell_web_view_forall (GtkContainer *container,
                          gboolean      include_internals,
@@ -919,18 +2458,136 @@ maxwell_web_view_load_changed (WebKitWebView  *webview,
                                WebKitLoadEvent event)
 {
   MaxwellWebViewPrivate *priv = MAXWELL_WEB_VIEW_PRIVATE (webview);
+  GList *l;
 
-  if (event != WEBKIT_LOAD_STARTED && event != WEBKIT_LOAD_FINISHED)
-    return;
+  /* Cancel all JS on load started, a new GCancellable object is created
+   * once the support script sends the ready message
+   */
+  if (event == WEBKIT_LOAD_STARTED)
+    {
+      children_cancellable_cancel (MAXWELL_WEB_VIEW (webview));
+      g_cancellable_cancel (priv->cancellable);
+      g_clear_object (&priv->cancellable);
 
-  /* Cancel all JS on load started */
-  children_cancellable_cancel (MAXWELL_WEB_VIEW (webview));
-  g_cancellable_cancel (priv->cancellable);
-  g_clear_object (&priv->cancellable);
+      /* New document, new frame cache */
+      memset (priv->frame_cache, 0, sizeof (priv->frame_cache));
 
-  /* Create a new GCancellable object when document finished loading */
-  if (event == WEBKIT_LOAD_FINISHED)
-    priv->cancellable = g_cancellable_new ();
+      /* The new document reports its own visibility */
+      webview_set_suspended (MAXWELL_WEB_VIEW (webview), SUSPEND_HIDDEN, FALSE);
+
+      /* And new canvases, release everything until we see them */
+      g_hash_table_remove_all (priv->canvases);
+
+      for (l = priv->children; l; l = g_list_next (l))
+        child_update_detached (MAXWELL_WEB_VIEW (webview), l->data);
+    }
+  else if (event == WEBKIT_LOAD_FINISHED && !priv->cancellable)
+    {
+      /* Fallback in case ready message never arrived */
+      priv->cancellable = g_cancellable_new ();
+    }
+}
+
+/* Send everything deferred while frozen as a single script */
+static void
+children_thaw (MaxwellWebView *webview)
+{
+  MaxwellWebViewPrivate *priv = MAXWELL_WEB_VIEW_PRIVATE (webview);
+  GList *l;
+
+  priv->batch = g_string_new ("");
+
+  for (l = priv->children; l; l = g_list_next (l))
+    {
+      ChildData *data = l->data;
+      const gchar *id = gtk_widget_get_name (data->child);
+
+      if (data->offscreen && id && data->thaw_visible)
+        g_string_append_printf (priv->batch,
+                                "maxwell.child_set_visible ('%s', %s);\n", id,
+                                gtk_widget_get_visible (data->child) ? "true" : "false");
+
+      if (data->offscreen && id && data->thaw_resize)
+        g_string_append_printf (priv->batch,
+                                "maxwell.child_resize ('%s', %d, %d, %d, %d);\n", id,
+                                data->alloc.width, data->alloc.height,
+                                data->minimum.width, data->minimum.height);
+
+      data->thaw_visible = data->thaw_resize = FALSE;
+    }
+
+  /* Followed by every frame held back */
+  if (priv->cancellable)
+    {
+      if (priv->flush_id)
+        {
+          g_source_remove (priv->flush_id);
+          priv->flush_id = 0;
+        }
+
+      if (priv->pending_id)
+        {
+          g_source_remove (priv->pending_id);
+          priv->pending_id = 0;
+        }
+
+      children_flush_scheduled (webview);
+      child_send_pending (webview);
+
+      js_run_string (webview, priv->view_id, priv->cancellable, priv->batch);
+    }
+
+  g_string_free (priv->batch, TRUE);
+  priv->batch = NULL;
+}
+
+static void
+maxwell_web_view_set_property (GObject      *object,
+                               guint         prop_id,
+                               const GValue *value,
+                               GParamSpec   *pspec)
+{
+  g_return_if_fail (MAXWELL_IS_WEB_VIEW (object));
+
+  switch (prop_id)
+    {
+    case PROP_MEMORY_BUDGET:
+      maxwell_web_view_set_memory_budget (MAXWELL_WEB_VIEW (object),
+                                          g_value_get_uint64 (value));
+      break;
+    case PROP_INLINE_THRESHOLD:
+      maxwell_web_view_set_inline_threshold (MAXWELL_WEB_VIEW (object),
+                                             g_value_get_uint (value));
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+    }
+}
+
+static void
+maxwell_web_view_get_property (GObject    *object,
+                               guint       prop_id,
+                               GValue     *value,
+                               GParamSpec *pspec)
+{
+  MaxwellWebViewPrivate *priv;
+
+  g_return_if_fail (MAXWELL_IS_WEB_VIEW (object));
+  priv = MAXWELL_WEB_VIEW_PRIVATE (object);
+
+  switch (prop_id)
+    {
+    case PROP_MEMORY_BUDGET:
+      g_value_set_uint64 (value, priv->memory_budget);
+      break;
+    case PROP_INLINE_THRESHOLD:
+      g_value_set_uint (value, priv->inline_threshold);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+    }
 }
 
 static void
@@ -942,10 +2599,16 @@ maxwell_web_view_class_init (MaxwellWebViewClass *klass)
   WebKitWebViewClass *web_view_class = WEBKIT_WEB_VIEW_CLASS (klass);
 
   object_class->dispose = maxwell_web_view_dispose;
+  object_class->finalize = maxwell_web_view_finalize;
   object_class->constructed = maxwell_web_view_constructed;
+  object_class->set_property = maxwell_web_view_set_property;
+  object_class->get_property = maxwell_web_view_get_property;
 
   widget_class->realize = maxwell_web_view_realize;
   widget_class->unrealize = maxwell_web_view_unrealize;
+  widget_class->map = maxwell_web_view_map;
+  widget_class->unmap = maxwell_web_view_unmap;
+  widget_class->hierarchy_changed = maxwell_web_view_hierarchy_changed;
   widget_class->size_allocate = maxwell_web_view_size_allocate;
   widget_class->draw = maxwell_web_view_draw;
   widget_class->damage_event = maxwell_web_view_damage_event;
@@ -956,12 +2619,79 @@ maxwell_web_view_class_init (MaxwellWebViewClass *klass)
   container_class->add = maxwell_web_view_add;
   container_class->remove = maxwell_web_view_remove;
   container_class->forall = maxwell_web_view_forall;
+  container_class->set_child_property = maxwell_web_view_set_child_property;
+  container_class->get_child_property = maxwell_web_view_get_child_property;
 
   web_view_class->load_changed = maxwell_web_view_load_changed;
+
+  /* Properties */
+  properties[PROP_MEMORY_BUDGET] =
+    g_param_spec_uint64 ("memory-budget",
+                         "Memory budget",
+                         "Offscreen memory in bytes hidden children can use before being released, 0 for no limit",
+                         0, G_MAXUINT64, 0,
+                         G_PARAM_READWRITE | G_PARAM_EXPLICIT_NOTIFY);
+
+  properties[PROP_INLINE_THRESHOLD] =
+    g_param_spec_uint ("inline-threshold",
+                       "Inline threshold",
+                       "Frames up to this size in bytes are sent inline instead of with a maxwell:// request, 0 to disable",
+                       0, G_MAXUINT, INLINE_THRESHOLD_DEFAULT,
+                       G_PARAM_READWRITE | G_PARAM_EXPLICIT_NOTIFY);
+
+  g_object_class_install_properties (object_class, N_PROPERTIES, properties);
+
+  /* Child properties */
+  gtk_container_class_install_child_property (container_class,
+                                              CHILD_PROP_MAX_FPS,
+                                              g_param_spec_uint ("max-fps",
+                                                                 "Maximum FPS",
+                                                                 "Maximum frames per second sent to the page, 0 for no limit",
+                                                                 0, G_MAXUINT, 0,
+                                                                 G_PARAM_READWRITE));
+
+  gtk_container_class_install_child_property (container_class,
+                                              CHILD_PROP_UPDATE_MODE,
+                                              g_param_spec_enum ("update-mode",
+                                                                 "Update mode",
+                                                                 "How changes are sent to the page",
+                                                                 MAXWELL_TYPE_UPDATE_MODE,
+                                                                 MAXWELL_UPDATE_MODE_CONTINUOUS,
+                                                                 G_PARAM_READWRITE));
+
+  gtk_container_class_install_child_property (container_class,
+                                              CHILD_PROP_OPAQUE,
+                                              g_param_spec_boolean ("opaque",
+                                                                    "Opaque",
+                                                                    "Whether the child paints every pixel so it does not need to be cleared",
+                                                                    FALSE,
+                                                                    G_PARAM_READWRITE));
 }
 
 /* Public API */
 
+GType
+maxwell_update_mode_get_type (void)
+{
+  static gsize type_id = 0;
+
+  if (g_once_init_enter (&type_id))
+    {
+      static const GEnumValue values[] = {
+        { MAXWELL_UPDATE_MODE_CONTINUOUS, "MAXWELL_UPDATE_MODE_CONTINUOUS", "continuous" },
+        { MAXWELL_UPDATE_MODE_ON_DEMAND, "MAXWELL_UPDATE_MODE_ON_DEMAND", "on-demand" },
+        { MAXWELL_UPDATE_MODE_SNAPSHOT, "MAXWELL_UPDATE_MODE_SNAPSHOT", "snapshot" },
+        { 0, NULL, NULL }
+      };
+      GType type = g_enum_register_static (g_intern_static_string ("MaxwellUpdateMode"),
+                                           values);
+
+      g_once_init_leave (&type_id, type);
+    }
+
+  return type_id;
+}
+
 /**
  * maxwell_web_view_new:
  *
@@ -976,3 +2706,218 @@ maxwell_web_view_new (void)
   return g_object_new (MAXWELL_TYPE_WEB_VIEW, NULL);
 }
 
+/**
+ * maxwell_web_view_update_child:
+ * @webview: a #MaxwellWebView
+ * @child: a child of @webview
+ *
+ * Sends @child changes held because its update-mode child property is
+ * %MAXWELL_UPDATE_MODE_ON_DEMAND. If it did not change yet, its next change
+ * will be sent.
+ */
+void
+maxwell_web_view_update_child (MaxwellWebView *webview, GtkWidget *child)
+{
+  MaxwellWebViewPrivate *priv;
+  ChildData *data;
+
+  g_return_if_fail (MAXWELL_IS_WEB_VIEW (webview));
+  priv = MAXWELL_WEB_VIEW_PRIVATE (webview);
+  g_return_if_fail (GTK_IS_WIDGET (child));
+  data = get_child_data_by_child (priv, child);
+  g_return_if_fail (data != NULL);
+
+  data->update_requested = TRUE;
+
+  if (!data->scheduled || !priv->cancellable || priv->freeze_count)
+    return;
+
+  /* Wait if over max-fps */
+  if (!child_flush (webview, data, g_get_monotonic_time ()))
+    children_queue_flush (webview);
+}
+
+/**
+ * maxwell_web_view_freeze_updates:
+ * @webview: a #MaxwellWebView
+ *
+ * Defers all updates to the page, like children visibility, size and
+ * contents, until maxwell_web_view_thaw_updates() is called.
+ *
+ * Use it when adding or changing many children at once. Calls can be nested,
+ * updates are sent when the last freeze is thawed.
+ */
+void
+maxwell_web_view_freeze_updates (MaxwellWebView *webview)
+{
+  g_return_if_fail (MAXWELL_IS_WEB_VIEW (webview));
+
+  MAXWELL_WEB_VIEW_PRIVATE (webview)->freeze_count++;
+}
+
+/**
+ * maxwell_web_view_thaw_updates:
+ * @webview: a #MaxwellWebView
+ *
+ * Reverts the effect of a previous call to maxwell_web_view_freeze_updates().
+ * Once the last freeze is thawed every deferred update is sent to the page
+ * in a single batch.
+ */
+void
+maxwell_web_view_thaw_updates (MaxwellWebView *webview)
+{
+  MaxwellWebViewPrivate *priv;
+
+  g_return_if_fail (MAXWELL_IS_WEB_VIEW (webview));
+  priv = MAXWELL_WEB_VIEW_PRIVATE (webview);
+  g_return_if_fail (priv->freeze_count > 0);
+
+  if (--priv->freeze_count == 0)
+    children_thaw (webview);
+}
+
+/**
+ * maxwell_web_view_set_memory_budget:
+ * @webview: a #MaxwellWebView
+ * @budget: memory in bytes or 0 for no limit
+ *
+ * Sets how much memory children offscreen windows can use. Once over budget
+ * the least recently visible hidden children release their offscreen window
+ * until they are shown again.
+ *
+ * Visible children are never released.
+ */
+void
+maxwell_web_view_set_memory_budget (MaxwellWebView *webview, guint64 budget)
+{
+  MaxwellWebViewPrivate *priv;
+
+  g_return_if_fail (MAXWELL_IS_WEB_VIEW (webview));
+  priv = MAXWELL_WEB_VIEW_PRIVATE (webview);
+
+  if (priv->memory_budget == budget)
+    return;
+
+  priv->memory_budget = budget;
+  children_reclaim (webview);
+
+  g_object_notify_by_pspec (G_OBJECT (webview), properties[PROP_MEMORY_BUDGET]);
+}
+
+/**
+ * maxwell_web_view_get_memory_budget:
+ * @webview: a #MaxwellWebView
+ *
+ * Returns: the memory budget in bytes, 0 means no limit
+ */
+guint64
+maxwell_web_view_get_memory_budget (MaxwellWebView *webview)
+{
+  g_return_val_if_fail (MAXWELL_IS_WEB_VIEW (webview), 0);
+
+  return MAXWELL_WEB_VIEW_PRIVATE (webview)->memory_budget;
+}
+
+/**
+ * maxwell_web_view_set_inline_threshold:
+ * @webview: a #MaxwellWebView
+ * @threshold: frame size in bytes or 0 to disable
+ *
+ * Sets the biggest frame, in bytes of pixel data, sent to the page inside the
+ * draw command itself instead of being fetched with a maxwell:// request.
+ *
+ * Inline frames are a third bigger but are painted without a round trip to
+ * the UI process which makes small frequent updates like a blinking cursor
+ * cheaper.
+ */
+void
+maxwell_web_view_set_inline_threshold (MaxwellWebView *webview, guint threshold)
+{
+  MaxwellWebViewPrivate *priv;
+
+  g_return_if_fail (MAXWELL_IS_WEB_VIEW (webview));
+  priv = MAXWELL_WEB_VIEW_PRIVATE (webview);
+
+  if (priv->inline_threshold == threshold)
+    return;
+
+  priv->inline_threshold = threshold;
+
+  g_object_notify_by_pspec (G_OBJECT (webview), properties[PROP_INLINE_THRESHOLD]);
+}
+
+/**
+ * maxwell_web_view_get_inline_threshold:
+ * @webview: a #MaxwellWebView
+ *
+ * Returns: the inline frame threshold in bytes, 0 means frames are never
+ *   sent inline
+ */
+guint
+maxwell_web_view_get_inline_threshold (MaxwellWebView *webview)
+{
+  g_return_val_if_fail (MAXWELL_IS_WEB_VIEW (webview), 0);
+
+  return MAXWELL_WEB_VIEW_PRIVATE (webview)->inline_threshold;
+}
+
+/**
+ * maxwell_web_view_get_statistics:
+ * @webview: a #MaxwellWebView
+ *
+ * Returns counters of what @webview sent to the page since it was created
+ * or since the last maxwell_web_view_reset_statistics(), useful to tune the
+ * update policy of an application.
+ *
+ * Every value is a 64 bit unsigned integer, keys are "frames", "bytes",
+ * "damage-single", "damage-split", "damage-union", "prerendered",
+ * "immediate", "cache-hits", "inlined" and "scrolls".
+ *
+ * Returns: (transfer full): a new #GVariant dictionary of type a{sv}
+ */
+GVariant *
+maxwell_web_view_get_statistics (MaxwellWebView *webview)
+{
+  MaxwellWebViewPrivate *priv;
+  GVariantBuilder builder;
+
+  g_return_val_if_fail (MAXWELL_IS_WEB_VIEW (webview), NULL);
+  priv = MAXWELL_WEB_VIEW_PRIVATE (webview);
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
+
+#define ADD_STAT(key, field) \
+  g_variant_builder_add (&builder, "{sv}", key, g_variant_new_uint64 (priv->stats.field))
+
+  ADD_STAT ("frames", frames);
+  ADD_STAT ("bytes", bytes);
+  ADD_STAT ("damage-single", damage_single);
+  ADD_STAT ("damage-split", damage_split);
+  ADD_STAT ("damage-union", damage_union);
+  ADD_STAT ("prerendered", prerendered);
+  ADD_STAT ("immediate", immediate);
+  ADD_STAT ("cache-hits", cache_hits);
+  ADD_STAT ("inlined", inlined);
+  ADD_STAT ("scrolls", scrolls);
+
+#undef ADD_STAT
+
+  return g_variant_ref_sink (g_variant_builder_end (&builder));
+}
+
+/**
+ * maxwell_web_view_reset_statistics:
+ * @webview: a #MaxwellWebView
+ *
+ * Sets every counter returned by maxwell_web_view_get_statistics() to 0.
+ */
+void
+maxwell_web_view_reset_statistics (MaxwellWebView *webview)
+{
+  MaxwellWebViewPrivate *priv;
+
+  g_return_if_fail (MAXWELL_IS_WEB_VIEW (webview));
+  priv = MAXWELL_WEB_VIEW_PRIVATE (webview);
+
+  memset (&priv->stats, 0, sizeof (priv->stats));
+}
@@ -28,10 +28,48 @@
 
 G_BEGIN_DECLS
 
+/**
+ * MaxwellUpdateMode:
+ * @MAXWELL_UPDATE_MODE_CONTINUOUS: changes are sent as soon as they happen
+ * @MAXWELL_UPDATE_MODE_ON_DEMAND: changes are held until
+ *   maxwell_web_view_update_child() is called
+ * @MAXWELL_UPDATE_MODE_SNAPSHOT: the page keeps showing the last frame and
+ *   changes are ignored
+ *
+ * How a child contents are sent to the page, see the update-mode child
+ * property.
+ */
+typedef enum
+{
+  MAXWELL_UPDATE_MODE_CONTINUOUS,
+  MAXWELL_UPDATE_MODE_ON_DEMAND,
+  MAXWELL_UPDATE_MODE_SNAPSHOT
+} MaxwellUpdateMode;
+
+#define MAXWELL_TYPE_UPDATE_MODE (maxwell_update_mode_get_type ())
+GType          maxwell_update_mode_get_type (void);
+
 #define MAXWELL_TYPE_WEB_VIEW (maxwell_web_view_get_type ())
 G_DECLARE_FINAL_TYPE (MaxwellWebView, maxwell_web_view, MAXWELL, WEB_VIEW, WebKitWebView)
 
-GtkWidget     *maxwell_web_view_new (void);
+GtkWidget     *maxwell_web_view_new               (void);
+
+void           maxwell_web_view_update_child      (MaxwellWebView *webview,
+                                                   GtkWidget      *child);
+
+void           maxwell_web_view_freeze_updates    (MaxwellWebView *webview);
+void           maxwell_web_view_thaw_updates      (MaxwellWebView *webview);
+
+void           maxwell_web_view_set_memory_budget (MaxwellWebView *webview,
+                                                   guint64         budget);
+guint64        maxwell_web_view_get_memory_budget (MaxwellWebView *webview);
+
+void           maxwell_web_view_set_inline_threshold (MaxwellWebView *webview,
+                                                      guint           threshold);
+guint          maxwell_web_view_get_inline_threshold (MaxwellWebView *webview);
+
+GVariant      *maxwell_web_view_get_statistics    (MaxwellWebView *webview);
+void           maxwell_web_view_reset_statistics  (MaxwellWebView *webview);
 
 G_END_DECLS
 
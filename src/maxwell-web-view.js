@@ -25,6 +25,56 @@
 
 let children = [];             /* List of children */
 let children_hash = new Map(); /* Hash table of children */
+let frame_cache = [];          /* Cached images by slot, managed by MaxwellWebView */
+let resize_buffer = null;      /* Scratch canvas keeping contents while resizing */
+let frame_stream = null;       /* Open maxwell:///view_id/stream, see frame_stream_open() */
+let layout_frame = 0;          /* requestAnimationFrame() id, 0 if none is scheduled */
+let layout_writes = new Map(); /* Style properties to set by child, see layout_run() */
+
+/* Collect ancestors that clip their content, computed once per child since
+ * getComputedStyle() is too expensive to call on every scroll event.
+ */
+function get_clip_ancestors (child) {
+    let ancestors = [];
+
+    for (let node = child.parentElement;
+         node && node !== document.body && node !== document.documentElement;
+         node = node.parentElement) {
+        let style = window.getComputedStyle(node);
+
+        if (style.overflowX !== 'visible' || style.overflowY !== 'visible')
+            ancestors.push(node);
+    }
+
+    return ancestors;
+}
+
+/* Returns the part of rect that is actually on screen, in canvas coordinates */
+function get_visible_rect (child, rect) {
+    let x1 = Math.max(rect.x, 0);
+    let y1 = Math.max(rect.y, 0);
+    let x2 = Math.min(rect.x + rect.width, window.innerWidth);
+    let y2 = Math.min(rect.y + rect.height, window.innerHeight);
+    let ancestors = child.maxwell.clip_ancestors;
+
+    /* Computed here since this is only called while reading the layout */
+    if (!ancestors)
+        ancestors = child.maxwell.clip_ancestors = get_clip_ancestors(child);
+
+    for (let i = 0, len = ancestors.length; i < len && x1 < x2 && y1 < y2; i++) {
+        let clip = ancestors[i].getBoundingClientRect();
+
+        x1 = Math.max(x1, clip.left);
+        y1 = Math.max(y1, clip.top);
+        x2 = Math.min(x2, clip.right);
+        y2 = Math.min(y2, clip.bottom);
+    }
+
+    if (x1 >= x2 || y1 >= y2)
+        return { x: 0, y: 0, width: 0, height: 0 };
+
+    return { x: x1 - rect.x, y: y1 - rect.y, width: x2 - x1, height: y2 - y1 };
+}
 
 function update_position_size () {
     let scale = window.devicePixelRatio;
@@ -33,7 +83,9 @@ function update_position_size () {
     for (let i = 0, len = children.length; i < len; i++) {
         let child = children[i];
         let child_rect = child.maxwell.rect;
+        let child_visible = child.maxwell.visible;
         let rect = child.getBoundingClientRect();
+        let visible;
 
         /* FIXME: Setting CSS zoom property breaks getBoundingClientRect()
          *
@@ -52,16 +104,23 @@ function update_position_size () {
             rect.height /= scale;
         }
 
-        /* Bail if position did not changed */
+        visible = get_visible_rect(child, rect);
+
+        /* Bail if position and visible area did not changed */
         if (child_rect &&
             child_rect.x === rect.x &&
             child_rect.y === rect.y &&
             child_rect.width === rect.width &&
-            child_rect.height === rect.height)
+            child_rect.height === rect.height &&
+            child_visible.x === visible.x &&
+            child_visible.y === visible.y &&
+            child_visible.width === visible.width &&
+            child_visible.height === visible.height)
             continue;
 
         /* Update position in cache */
         child.maxwell.rect = rect;
+        child.maxwell.visible = visible;
 
         /* Ensure array */
         if (!positions)
@@ -73,7 +132,11 @@ function update_position_size () {
             x: rect.x,
             y: rect.y,
             width: child.maxwell.dom_width ? rect.width : -1,
-            height: child.maxwell.dom_height ? rect.height : -1
+            height: child.maxwell.dom_height ? rect.height : -1,
+            visible_x: visible.x,
+            visible_y: visible.y,
+            visible_width: visible.width,
+            visible_height: visible.height
         });
     }
 
@@ -82,71 +145,613 @@ function update_position_size () {
         window.webkit.messageHandlers.maxwell_children_move_resize.postMessage(positions);
 }
 
-/* We need to update widget positions on scroll and resize events */
-window.addEventListener("scroll", update_position_size, { passive: true });
-window.addEventListener("resize", update_position_size, { passive: true });
+/* Layout
+ *
+ * Reading the layout right after changing a style forces a synchronous
+ * layout, which would happen for every child if each command wrote its
+ * styles and then read positions back.
+ * Instead, style changes are queued with child_set_style() and applied once
+ * per frame by layout_run() after reading every position, so updating N
+ * children costs a single layout.
+ */
+function layout_run () {
+    layout_frame = 0;
+
+    /* Read phase, nothing in here can write to the DOM */
+    update_position_size();
+
+    if (!layout_writes.size)
+        return;
+
+    /* Write phase */
+    layout_writes.forEach((style, child) => {
+        if (child.isConnected)
+            Object.assign(child.style, style);
+    });
+    layout_writes.clear();
+
+    /* Read the resulting positions on the next frame */
+    layout_queue();
+}
+
+function layout_queue () {
+    if (!layout_frame)
+        layout_frame = window.requestAnimationFrame(layout_run);
+}
+
+/* Sets style properties on child in the next write phase */
+function child_set_style (child, style) {
+    let pending = layout_writes.get(child);
+
+    if (pending)
+        Object.assign(pending, style);
+    else
+        layout_writes.set(child, style);
+
+    layout_queue();
+}
+
+/* We need to update widget positions on scroll and resize events, scroll
+ * does not bubble so we capture it to also get scrolling elements
+ */
+window.addEventListener("scroll", layout_queue, { passive: true, capture: true });
+window.addEventListener("resize", layout_queue, { passive: true });
+
+/* Renderers
+ *
+ * A renderer keeps the canvas contents, draw() updates part of it with an
+ * ImageData, scroll() moves part of it, present() makes the updates visible
+ * and resize() changes the canvas size keeping as much of its contents as
+ * possible.
+ */
+
+/* Returns the scratch canvas, at least width x height */
+function get_scratch_buffer (width, height) {
+    if (!resize_buffer)
+        resize_buffer = document.createElement('canvas');
+
+    /* Only grow it, resizing a canvas reallocates it */
+    if (resize_buffer.width < width || resize_buffer.height < height) {
+        resize_buffer.width = Math.max(resize_buffer.width, width);
+        resize_buffer.height = Math.max(resize_buffer.height, height);
+    }
+
+    return resize_buffer;
+}
+
+/* Default 2D context renderer */
+function renderer_2d_new (child) {
+    let ctx = child.getContext('2d');
+
+    return {
+        draw: function (image, x, y) {
+            ctx.globalCompositeOperation = "copy";
+            ctx.putImageData(image, x, y);
+        },
+
+        scroll: function (x, y, width, height, dx, dy) {
+            /* Go through the scratch canvas, the areas overlap */
+            let buffer = get_scratch_buffer(width, height);
+            let buffer_ctx = buffer.getContext('2d');
+
+            buffer_ctx.globalCompositeOperation = "copy";
+            buffer_ctx.drawImage(child, x, y, width, height, 0, 0, width, height);
+
+            ctx.clearRect(x + dx, y + dy, width, height);
+            ctx.globalCompositeOperation = "source-over";
+            ctx.drawImage(buffer, 0, 0, width, height, x + dx, y + dy, width, height);
+        },
+
+        lost: false,
+
+        present: function () {
+        },
+
+        resize: function (width, height) {
+            /* Resizing canvas clears it, so we need to save the image contents.
+             * Copy it to a scratch canvas instead of reading it back with
+             * getImageData() which forces a synchronous GPU to CPU transfer.
+             */
+            let old_width = Math.min(child.width, width);
+            let old_height = Math.min(child.height, height);
+
+            if (old_width && old_height) {
+                get_scratch_buffer(old_width, old_height);
+
+                let buffer_ctx = resize_buffer.getContext('2d');
+                buffer_ctx.globalCompositeOperation = "copy";
+                buffer_ctx.drawImage(child, 0, 0, old_width, old_height,
+                                     0, 0, old_width, old_height);
+            }
+
+            child.width = width;
+            child.height = height;
+
+            /* Repaint old image to avoid flickering */
+            if (old_width && old_height) {
+                ctx.globalCompositeOperation = "copy";
+                ctx.drawImage(resize_buffer, 0, 0, old_width, old_height,
+                              0, 0, old_width, old_height);
+            }
+        },
+    };
+}
+
+const WEBGL_VERTEX_SHADER = `
+attribute vec2 position;
+varying vec2 texcoord;
+void main () {
+    texcoord = position;
+    gl_Position = vec4(position.x * 2.0 - 1.0, 1.0 - position.y * 2.0, 0.0, 1.0);
+}`;
+
+const WEBGL_FRAGMENT_SHADER = `
+precision mediump float;
+uniform sampler2D image;
+varying vec2 texcoord;
+void main () {
+    gl_FragColor = texture2D(image, texcoord);
+}`;
+
+const WEBGL_ATTRIBUTES = {
+    alpha: true,
+    premultipliedAlpha: false,
+    preserveDrawingBuffer: false,
+    antialias: false,
+    depth: false,
+    failIfMajorPerformanceCaveat: true,
+};
+
+/* WebKit loses the oldest context once a page has 16, leave some to the page */
+const WEBGL_MAX_CONTEXTS = 8;
+
+let webgl_available = undefined; /* Unknown until first WebGL canvas */
+let webgl_contexts = 0;          /* WebGL children contexts alive */
+
+/* Canvases the page dropped take their context with them */
+let webgl_registry = window.FinalizationRegistry ?
+    new FinalizationRegistry(() => webgl_contexts--) : null;
+
+function webgl_compile (gl, type, source) {
+    let shader = gl.createShader(type);
+
+    gl.shaderSource(shader, source);
+    gl.compileShader(shader);
+
+    return gl.getShaderParameter(shader, gl.COMPILE_STATUS) ? shader : null;
+}
+
+/* Returns a program drawing a texture, or null */
+function webgl_program_new (gl) {
+    let vertex = webgl_compile(gl, gl.VERTEX_SHADER, WEBGL_VERTEX_SHADER);
+    let fragment = webgl_compile(gl, gl.FRAGMENT_SHADER, WEBGL_FRAGMENT_SHADER);
+    let program;
+
+    if (!vertex || !fragment)
+        return null;
+
+    program = gl.createProgram();
+    gl.attachShader(program, vertex);
+    gl.attachShader(program, fragment);
+    gl.linkProgram(program);
+
+    return gl.getProgramParameter(program, gl.LINK_STATUS) ? program : null;
+}
+
+/* A canvas can only ever have one context type, so we try WebGL on a scratch
+ * canvas first to be able to fall back to 2D on the real one.
+ */
+function webgl_check_available () {
+    if (webgl_available === undefined) {
+        let gl = document.createElement('canvas').getContext('webgl', WEBGL_ATTRIBUTES);
+
+        webgl_available = (gl && webgl_program_new(gl)) ? true : false;
+
+        if (gl && gl.getExtension('WEBGL_lose_context'))
+            gl.getExtension('WEBGL_lose_context').loseContext();
+    }
+
+    return webgl_available;
+}
+
+function webgl_texture_new (gl, width, height) {
+    let texture = gl.createTexture();
+
+    gl.bindTexture(gl.TEXTURE_2D, texture);
+
+    /* Non power of two textures need clamping and no mipmaps in WebGL 1 */
+    gl.texParameteri(gl.TEXTURE_2D, gl.TEXTURE_WRAP_S, gl.CLAMP_TO_EDGE);
+    gl.texParameteri(gl.TEXTURE_2D, gl.TEXTURE_WRAP_T, gl.CLAMP_TO_EDGE);
+    gl.texParameteri(gl.TEXTURE_2D, gl.TEXTURE_MIN_FILTER, gl.NEAREST);
+    gl.texParameteri(gl.TEXTURE_2D, gl.TEXTURE_MAG_FILTER, gl.NEAREST);
+    gl.texImage2D(gl.TEXTURE_2D, 0, gl.RGBA, width, height, 0,
+                  gl.RGBA, gl.UNSIGNED_BYTE, null);
+
+    return texture;
+}
+
+/* Returns the top left width x height pixels of image for texSubImage2D() */
+function webgl_clip_pixels (image, width, height) {
+    let data = image.data;
+    let stride = image.width * 4;
+
+    if (width === image.width)
+        return new Uint8Array(data.buffer, data.byteOffset, stride * height);
+
+    let pixels = new Uint8Array(width * height * 4);
+
+    for (let row = 0; row < height; row++)
+        pixels.set(new Uint8Array(data.buffer, data.byteOffset + row * stride, width * 4),
+                   row * width * 4);
+
+    return pixels;
+}
+
+/* WebGL renderer, updates are uploaded with texSubImage2D() into a texture
+ * the size of the canvas which present() draws with a single quad straight
+ * into the child canvas, nothing is read back from the GPU.
+ *
+ * The child canvas is stuck with its WebGL context, if it gets lost or can
+ * not hold the child size the canvas is replaced, see child_fall_back_2d().
+ */
+function renderer_webgl_new (child, gl) {
+    let program = webgl_program_new(gl);
+    let token = {};
+    let lost = !program;
+    let texture = null;
+
+    /* Stops counting the context, losing it if it is still alive */
+    function release () {
+        if (lost)
+            return;
+
+        lost = true;
+        webgl_contexts--;
+
+        if (webgl_registry)
+            webgl_registry.unregister(token);
+
+        if (!gl.isContextLost() && gl.getExtension('WEBGL_lose_context'))
+            gl.getExtension('WEBGL_lose_context').loseContext();
+    }
+
+    /* A GPU reset is likely to happen again, so new children use 2D from now
+     * on. Detached children fall back once they are attached again.
+     */
+    child.addEventListener('webglcontextlost', () => {
+        if (lost)
+            return;
+
+        release();
+        webgl_available = false;
+
+        if (children_hash[child.id] === child)
+            child_fall_back_2d(child, false);
+    });
+
+    if (lost)
+        return { lost: true, draw () {}, scroll () {}, present () {}, resize () {} };
+
+    webgl_contexts++;
+
+    if (webgl_registry)
+        webgl_registry.register(child, null, token);
+
+    gl.useProgram(program);
+
+    /* Two triangles covering the whole canvas */
+    let position = gl.getAttribLocation(program, 'position');
+    gl.bindBuffer(gl.ARRAY_BUFFER, gl.createBuffer());
+    gl.bufferData(gl.ARRAY_BUFFER, new Float32Array([0, 0, 1, 0, 0, 1, 0, 1, 1, 0, 1, 1]),
+                  gl.STATIC_DRAW);
+    gl.enableVertexAttribArray(position);
+    gl.vertexAttribPointer(position, 2, gl.FLOAT, false, 0, 0);
+
+    let framebuffer = gl.createFramebuffer();
+    let max_size = gl.getParameter(gl.MAX_TEXTURE_SIZE);
+
+    return {
+        get lost () {
+            return lost;
+        },
+
+        draw: function (image, x, y) {
+            /* Same clipping putImageData() does */
+            let width = Math.min(image.width, child.width - x);
+            let height = Math.min(image.height, child.height - y);
+
+            if (!texture || width <= 0 || height <= 0)
+                return;
+
+            if (width === image.width && height === image.height)
+                gl.texSubImage2D(gl.TEXTURE_2D, 0, x, y, gl.RGBA, gl.UNSIGNED_BYTE, image);
+            else
+                gl.texSubImage2D(gl.TEXTURE_2D, 0, x, y, width, height,
+                                 gl.RGBA, gl.UNSIGNED_BYTE,
+                                 webgl_clip_pixels(image, width, height));
+        },
+
+        scroll: function (x, y, width, height, dx, dy) {
+            /* Both source and destination have to be inside the texture */
+            let x1 = Math.max(x, -dx, 0);
+            let y1 = Math.max(y, -dy, 0);
+            let x2 = Math.min(x + width, child.width - dx, child.width);
+            let y2 = Math.min(y + height, child.height - dy, child.height);
+
+            if (!texture || x1 >= x2 || y1 >= y2)
+                return;
+
+            width = x2 - x1;
+            height = y2 - y1;
+
+            /* A texture can not be copied onto itself, go through a
+             * temporary one, all on the GPU. webgl_texture_new() leaves
+             * it bound so the first copy goes there.
+             */
+            let temp = webgl_texture_new(gl, width, height);
+
+            gl.bindFramebuffer(gl.FRAMEBUFFER, framebuffer);
+            gl.framebufferTexture2D(gl.FRAMEBUFFER, gl.COLOR_ATTACHMENT0,
+                                    gl.TEXTURE_2D, texture, 0);
+            gl.copyTexSubImage2D(gl.TEXTURE_2D, 0, 0, 0, x1, y1, width, height);
+
+            gl.framebufferTexture2D(gl.FRAMEBUFFER, gl.COLOR_ATTACHMENT0,
+                                    gl.TEXTURE_2D, temp, 0);
+            gl.bindTexture(gl.TEXTURE_2D, texture);
+            gl.copyTexSubImage2D(gl.TEXTURE_2D, 0, x1 + dx, y1 + dy, 0, 0, width, height);
+            gl.bindFramebuffer(gl.FRAMEBUFFER, null);
+            gl.deleteTexture(temp);
+        },
+
+        present: function () {
+            if (texture)
+                gl.drawArrays(gl.TRIANGLES, 0, 6);
+        },
+
+        resize: function (width, height) {
+            /* Too big for the GPU, the 2D renderer keeps the contents. The
+             * drawing buffer is only valid until the page is composited so
+             * draw it again before copying it.
+             */
+            if (width > max_size || height > max_size) {
+                this.present();
+                child_fall_back_2d(child, true).maxwell.renderer.resize(width, height);
+                release();
+                return;
+            }
+
+            let old_width = Math.min(child.width, width);
+            let old_height = Math.min(child.height, height);
+            let old_texture = texture;
+
+            child.width = width;
+            child.height = height;
+
+            /* The drawing buffer got clamped, present() would scale */
+            if (width && height &&
+                (gl.drawingBufferWidth !== width || gl.drawingBufferHeight !== height)) {
+                release();
+                child_fall_back_2d(child, false);
+                return;
+            }
+
+            gl.viewport(0, 0, width, height);
+            texture = (width && height) ? webgl_texture_new(gl, width, height) : null;
+
+            /* Keep old contents copying them on the GPU */
+            if (old_texture && texture && old_width && old_height) {
+                gl.bindFramebuffer(gl.FRAMEBUFFER, framebuffer);
+                gl.framebufferTexture2D(gl.FRAMEBUFFER, gl.COLOR_ATTACHMENT0,
+                                        gl.TEXTURE_2D, old_texture, 0);
+                gl.copyTexSubImage2D(gl.TEXTURE_2D, 0, 0, 0, 0, 0, old_width, old_height);
+                gl.bindFramebuffer(gl.FRAMEBUFFER, null);
+            }
+
+            if (old_texture)
+                gl.deleteTexture(old_texture);
+
+            this.present();
+        },
+    };
+}
+
+/* WebGL is opt in with data-maxwell-renderer="webgl" on the canvas element,
+ * 2D is used if it is not available, would be software rendered or there
+ * are WEBGL_MAX_CONTEXTS WebGL children already.
+ */
+function renderer_new (child) {
+    if (child.dataset.maxwellRenderer === 'webgl' &&
+        webgl_contexts < WEBGL_MAX_CONTEXTS && webgl_check_available()) {
+        /* Null if the page already got a 2D context */
+        let gl = child.getContext('webgl', WEBGL_ATTRIBUTES);
+
+        if (gl)
+            return renderer_webgl_new(child, gl);
+    }
+
+    return renderer_2d_new(child);
+}
+
+/* A canvas can not change its context type, so a WebGL child that lost its
+ * context is replaced with a copy of the element using the 2D renderer.
+ * It keeps its id, attributes and Maxwell data but not the event listeners
+ * the page added to it.
+ *
+ * Keeps the canvas contents if keep is true, otherwise MaxwellWebView is
+ * asked to send them again. Returns the new canvas.
+ */
+function child_fall_back_2d (child, keep) {
+    let canvas = child.cloneNode(false);
+    let style = layout_writes.get(child);
+
+    /* Shared, so draws in flight for the old canvas land in the new one */
+    canvas.maxwell = child.maxwell;
+    canvas.width = child.width;
+    canvas.height = child.height;
+    canvas.maxwell.renderer = renderer_2d_new(canvas);
+
+    if (keep && child.width && child.height)
+        canvas.getContext('2d').drawImage(child, 0, 0);
+
+    /* Swap it before the DOM change so the observer takes it as a move */
+    children[children.indexOf(child)] = canvas;
+    children_hash[child.id] = canvas;
+
+    if (style) {
+        layout_writes.delete(child);
+        layout_writes.set(canvas, style);
+    }
+
+    child.replaceWith(canvas);
+
+    if (!keep)
+        window.webkit.messageHandlers.maxwell_children_repaint.postMessage([canvas.id]);
+
+    return canvas;
+}
+
+/* Calls func for every GtkWidget canvas in node, including node itself */
+function foreach_canvas (node, func) {
+    if (node.nodeType !== Node.ELEMENT_NODE)
+        return;
+
+    if (node.id && node.tagName === 'CANVAS' && node.classList.contains('GtkWidget'))
+        func(node);
+
+    let canvases = node.getElementsByClassName('GtkWidget');
+
+    for (let i = 0, len = canvases.length; i < len; i++) {
+        let child = canvases[i];
+
+        if (child.id && child.tagName === 'CANVAS')
+            func(child);
+    }
+}
+
+function child_setup (child) {
+    let old = child.maxwell;
+
+    /* Setup child data, canvases attached again keep their original values
+     * since we changed their style
+     */
+    child.maxwell = {
+        display_value: old ? old.display_value : child.style.display,
+        draw_requests: [],
+        dom_width: old ? old.dom_width : (child.style.width && child.style.width !== 'auto') || false,
+        dom_height: old ? old.dom_height : (child.style.height && child.style.height !== 'auto') || false,
+        clip_ancestors: null,
+        renderer: old ? old.renderer : renderer_new(child),
+    };
+
+    /* Lost while detached, or right away. Replace it once the page knows
+     * about the child, after the mutation handler is done.
+     */
+    if (child.maxwell.renderer.lost)
+        Promise.resolve().then(() => {
+            if (children_hash[child.id] === child)
+                child_fall_back_2d(child, false);
+        });
+
+    /* Hide all widgets by default, these are only writes so they do not have
+     * to wait for the next frame.
+     */
+    child.style.display = 'none';
+
+    /* Make sure canvas content do not get stretched when the style size changes */
+    child.style.objectFit = 'none';
+
+    /* Make sure content position is at start */
+    child.style.objectPosition = 'left top';
+
+    /* And set no size (canvas default is 300x150) */
+    child.width = 0;
+    child.height = 0;
+
+    /* Keep a reference in a hash table for quick lookup */
+    children_hash[child.id] = child;
+
+    /* And another one in an array for quick iteration */
+    children.push(child);
+}
+
+function child_detach (child) {
+    /* Stop tracking it, child.maxwell is kept in case it gets attached again */
+    children.splice(children.indexOf(child), 1);
+    delete children_hash[child.id];
+
+    child.maxwell.draw_requests.forEach((draw) => {
+        if (draw.xhr && !draw.xhr.maxwell.entry)
+            draw.xhr.abort();
+    });
+    child.maxwell.draw_requests = [];
+    child.maxwell.rect = null;
+    layout_writes.delete(child);
+}
 
 /* We also need to update it on any DOM change */
 function document_mutation_handler (mutations) {
     let new_children = null;
+    let removed_children = null;
 
     for (var mutation of mutations) {
         if (mutation.type !== 'childList')
             continue;
 
-        for (let i = 0, len = mutation.addedNodes.length; i < len; i++) {
-            let child = mutation.addedNodes[i];
-
-            if (!child.id || child.tagName !== 'CANVAS' ||
-                !child.classList.contains('GtkWidget'))
-                continue;
-
-            /* Setup child data */
-            child.maxwell = {
-                display_value: child.style.display,
-                draw_requests: [],
-                dom_width: (child.style.width && child.style.width !== 'auto') || false,
-                dom_height: (child.style.height && child.style.height !== 'auto') || false,
-            };
+        for (let i = 0, len = mutation.removedNodes.length; i < len; i++) {
+            foreach_canvas(mutation.removedNodes[i], (child) => {
+                /* Moved nodes are removed and added back */
+                if (child.isConnected || children_hash[child.id] !== child)
+                    return;
 
-            /* Hide all widgets by default */
-            child.style.display = 'none';
+                child_detach(child);
 
-            /* Make sure canvas content do not get stretched when the style size changes */
-            child.style.objectFit = 'none';
+                /* Ensure array */
+                if (!removed_children)
+                    removed_children = [];
 
-            /* Make sure content position is at start */
-            child.style.objectPosition = 'left top';
+                /* Collect children to release */
+                removed_children.push(child.id);
+            });
+        }
 
-            /* And set no size (canvas default is 300x150) */
-            child.width = 0;
-            child.height = 0;
+        for (let i = 0, len = mutation.addedNodes.length; i < len; i++) {
+            foreach_canvas(mutation.addedNodes[i], (child) => {
+                /* Already known, it was just moved */
+                if (children_hash[child.id] === child) {
+                    child.maxwell.clip_ancestors = null;
+                    return;
+                }
 
-            /* Keep a reference in a hash table for quick lookup */
-            children_hash[child.id] = child;
+                /* Added and removed before we got to see it */
+                if (!child.isConnected)
+                    return;
 
-            /* And another one in an array for quick iteration */
-            children.push(child);
+                child_setup(child);
 
-            /* Ensure array */
-            if (!new_children)
-                new_children = [];
+                /* Ensure array */
+                if (!new_children)
+                    new_children = [];
 
-            /* Collect children to allocate */
-            new_children.push({
-                id: child.id,
-                use_dom_size: (child.maxwell.dom_width || child.maxwell.dom_height),
+                /* Collect children to allocate */
+                new_children.push({
+                    id: child.id,
+                    use_dom_size: (child.maxwell.dom_width || child.maxwell.dom_height),
+                });
             });
         }
     }
 
+    /* Removals first, a new canvas might reuse the id of a removed one */
+    if (removed_children)
+        window.webkit.messageHandlers.maxwell_children_remove.postMessage(removed_children);
+
     if (new_children)
         window.webkit.messageHandlers.maxwell_children_init.postMessage(new_children);
 
     /* Extra paranoid, update positions if anything changes in the DOM tree!
      * ideally it would be nice to directly observe BoundingClientRect changes.
      */
-    update_position_size();
+    layout_queue();
 };
 
 /* Main DOM observer */
@@ -182,85 +787,308 @@ window.maxwell.child_resize = function (id, width, height, minWidth, minHeight)
     if (!child || (child.width === width && child.height === height))
         return;
 
-    if (scale !== 1)
-        child.style.zoom = 1/scale;
-
-    /* Abort all pending draw request */
-    child.maxwell.draw_requests.forEach((req) => { req.abort(); });
-    child.maxwell.draw_requests = [];
-
-    /* Resizing canvas clears it, so we need to save the image contents */
-    let ctx = child.getContext('2d');
-    let image = null;
+    /* Pending draws are in widget coordinates which do not change, newer
+     * frames will overwrite anything stale. So only drop the ones that fall
+     * outside the new size, except the ones filling the frame cache since
+     * other children might be waiting for them.
+     */
+    child.maxwell.draw_requests = child.maxwell.draw_requests.filter((draw) => {
+        if (draw.x * scale < width && draw.y * scale < height)
+            return true;
 
-    if (child.width && child.height)
-        image = ctx.getImageData(0, 0, child.width, child.height);
+        if (draw.xhr && !draw.xhr.maxwell.entry)
+            draw.xhr.abort();
 
-    /* Resize canvas to the actual widget allocation */
-    child.width = width;
-    child.height = height;
+        return false;
+    });
 
-    /* Repaint old image to avoid flickering */
-    if (image) {
-        ctx.globalCompositeOperation = "copy";
-        ctx.putImageData(image, 0, 0);
-    }
+    /* Resize canvas to the actual widget allocation, right away since the
+     * draws that follow are already for the new size.
+     */
+    child.maxwell.renderer.resize(width, height);
 
     /* Minimum size as returned by gtk_widget_get_preferred_size() */
-    child.style.minWidth = minWidth + 'px';
-    child.style.minHeight = minHeight + 'px';
+    let style = {
+        minWidth: minWidth + 'px',
+        minHeight: minHeight + 'px',
+    };
+
+    if (scale !== 1)
+        style.zoom = 1/scale;
 
     /* Force DOM tree to honor sizes from GTK */
     if (!child.maxwell.dom_width)
-        child.style.width = minWidth + 'px';
+        style.width = minWidth + 'px';
 
     if (!child.maxwell.dom_height)
-        child.style.height = minHeight + 'px';
+        style.height = minHeight + 'px';
+
+    child_set_style(child, style);
 }
 
-function on_child_draw_load () {
-    let child = this.maxwell.child;
+/* Paint every draw request that is ready, in order */
+function child_flush_draw_requests (child) {
     let requests = child.maxwell.draw_requests;
-    let ctx = child.getContext('2d');
+    let renderer = child.maxwell.renderer;
+    let scale = window.devicePixelRatio;
     let i, len;
 
-    /* Remove request if failed, otherwise it will be removed once drawn */
-    if (!this.response)
-        requests.splice(requests.indexOf(this), 1);
+    for (i = 0, len = requests.length; i < len; i++) {
+        let draw = requests[i];
+        let entry = draw.entry;
+
+        if (entry ? !entry.done : !draw.done)
+            break;
 
-    ctx.globalCompositeOperation = "copy";
+        let image = entry ? entry.image : draw.image;
+
+        /* Failed requests are just skipped */
+        if (draw.scroll)
+            renderer.scroll(draw.x * scale, draw.y * scale,
+                            draw.width * scale, draw.height * scale,
+                            draw.scroll.dx * scale, draw.scroll.dy * scale);
+        else if (image)
+            renderer.draw(image, draw.x * scale, draw.y * scale);
+    }
 
-    for (i = 0, len = requests.length; i < len && requests[i].response; i++) {
-        let dReq = requests[i];
-        let data = new Uint8ClampedArray(dReq.response);
+    if (i)
+        renderer.present();
 
+    /* Remove all request that were drawn */
+    requests.splice(0, i);
+}
+
+/* Lets MaxwellWebView know the image for entry could not be stored, so it
+ * stops using its slot and sends the children that needed it again
+ */
+function frame_cache_failed (entry, children) {
+    /* Slot already reused */
+    if (frame_cache[entry.slot] !== entry)
+        return;
+
+    frame_cache[entry.slot] = null;
+    window.webkit.messageHandlers.maxwell_frame_cache_failed.postMessage(
+        [entry.slot].concat(children.map((child) => child.id)));
+}
+
+/* Paints req draw with data pixels, null if the frame could not be fetched */
+function child_draw_finish (req, data) {
+    let draw = req.draw;
+    let entry = req.entry;
+    let image = null;
+
+    if (data) {
         try {
             let scale = window.devicePixelRatio;
-            let image = new ImageData(data, dReq.maxwell.width * scale, dReq.maxwell.height * scale);
 
-            /* Update contents */
-            ctx.putImageData(image, dReq.maxwell.x * scale, dReq.maxwell.y * scale);
+            image = new ImageData(data, draw.width * scale, draw.height * scale);
         } catch (error) {
             console.log(error);
         }
     }
 
-    /* Remove all request that were drawn */
-    requests.splice(0, i);
+    draw.image = image;
+    draw.done = true;
+
+    if (req.child)
+        child_flush_draw_requests(req.child);
+
+    if (!entry)
+        return;
+
+    /* Let other children waiting for this image paint it */
+    entry.image = image;
+    entry.done = true;
+    entry.waiting.forEach((child) => {
+        if (child !== req.child)
+            child_flush_draw_requests(child);
+    });
+
+    if (!image)
+        frame_cache_failed(entry, req.child ? entry.waiting.concat(req.child) : entry.waiting);
+
+    entry.waiting = null;
+}
+
+function on_child_draw_load () {
+    child_draw_finish(this.maxwell,
+                      this.response ? new Uint8ClampedArray(this.response) : null);
+}
+
+/* Creates a draw request, returns null if nobody needs the image */
+function child_draw_request_new (id, x, y, width, height, cache_slot) {
+    let child = children_hash[id];
+    let entry = null;
+
+    /* MaxwellWebView assumes the slot is filled no matter what */
+    if (cache_slot) {
+        entry = { slot: cache_slot, image: null, done: false, waiting: [] };
+        frame_cache[cache_slot] = entry;
+    }
+
+    if (!child && !entry)
+        return null;
+
+    let draw = { x, y, width, height, xhr: null, image: null, done: false };
+
+    /* Add request to stack */
+    if (child)
+        child.maxwell.draw_requests.push(draw);
+
+    return { child, draw, entry };
+}
+
+/* Reads frame records, a little endian 32 bit frame id and length followed
+ * by the pixels, as they arrive.
+ */
+function frame_stream_read (stream, reader) {
+    let header = new Uint8Array(8);
+    let header_len = 0;
+    let frame_id = 0;
+    let pixels = null;
+    let pixels_len = 0;
+
+    function consume (chunk) {
+        let offset = 0;
+
+        while (offset < chunk.length) {
+            if (!pixels) {
+                let n = Math.min(8 - header_len, chunk.length - offset);
+
+                header.set(chunk.subarray(offset, offset + n), header_len);
+                header_len += n;
+                offset += n;
+
+                if (header_len < 8)
+                    break;
+
+                let view = new DataView(header.buffer);
+                frame_id = view.getUint32(0, true);
+                pixels = new Uint8ClampedArray(view.getUint32(4, true));
+                pixels_len = 0;
+                header_len = 0;
+            }
+
+            let n = Math.min(pixels.length - pixels_len, chunk.length - offset);
+
+            pixels.set(chunk.subarray(offset, offset + n), pixels_len);
+            pixels_len += n;
+            offset += n;
+
+            if (pixels_len === pixels.length) {
+                frame_stream_frame(stream, frame_id, pixels);
+                pixels = null;
+            }
+        }
+    }
+
+    function pump () {
+        return reader.read().then((result) => {
+            if (result.done)
+                return;
+
+            consume(result.value);
+            return pump();
+        });
+    }
+
+    return pump();
+}
+
+function frame_stream_frame (stream, frame_id, pixels) {
+    let req = stream.requests.get(frame_id);
+
+    /* The record can arrive before its draw command */
+    if (req === undefined) {
+        stream.frames.set(frame_id, pixels);
+        return;
+    }
+
+    stream.requests.delete(frame_id);
+
+    if (req)
+        child_draw_finish(req, pixels);
+}
+
+function frame_stream_close (stream) {
+    if (frame_stream === stream)
+        frame_stream = null;
+
+    /* Frames that will never come are skipped */
+    stream.requests.forEach((req) => {
+        if (req)
+            child_draw_finish(req, null);
+    });
+    stream.requests.clear();
+    stream.frames.clear();
+}
+
+/* frame_stream_open()
+ *
+ * Start reading frames from uri, an endless response MaxwellWebView writes
+ * frames to as soon as they are ready, saving a request per frame.
+ * Nothing happens if streaming response bodies are not supported, frames
+ * keep being fetched one by one with child_draw()
+ */
+window.maxwell.frame_stream_open = function (uri) {
+    if (!window.fetch || !window.ReadableStream)
+        return;
+
+    let stream = { requests: new Map(), frames: new Map() };
+
+    if (frame_stream)
+        frame_stream_close(frame_stream);
+
+    frame_stream = stream;
+
+    fetch(uri).then((response) => {
+        if (!response.ok || !response.body || !response.body.getReader)
+            throw new Error('Can not stream ' + uri);
+
+        return frame_stream_read(stream, response.body.getReader());
+    }).catch((error) => {
+        console.log(error);
+    }).then(() => {
+        frame_stream_close(stream);
+    });
+}
+
+/* child_draw_streamed()
+ *
+ * Same as child_draw() but the image comes from the frame stream
+ */
+window.maxwell.child_draw_streamed = function (id, frame_id, x, y, width, height, cache_slot) {
+    let req = child_draw_request_new(id, x, y, width, height, cache_slot);
+    let pixels = null;
+
+    if (frame_stream) {
+        pixels = frame_stream.frames.get(frame_id);
+        frame_stream.frames.delete(frame_id);
+
+        /* Remember to drop the record if nobody needs it */
+        if (!pixels) {
+            frame_stream.requests.set(frame_id, req);
+            return;
+        }
+    }
+
+    if (req)
+        child_draw_finish(req, pixels);
 }
 
 /* child_draw()
  *
  * Draw child canvas with maxwell:///canvasid image
  *
- * Unfortunatelly WebGL does not support texture_from_pixmap but we might be able
- * to use GL to implement this function if we can get the context from WebKit
- * itself
+ * If cache_slot is not 0 the image is also kept in the frame cache under that
+ * slot, replacing whatever was there, for child_draw_cached() to use.
+ *
+ * The image is painted by the child renderer, see renderer_new()
  */
-window.maxwell.child_draw = function (id, image_id, x, y, width, height) {
-    let child = children_hash[id];
+window.maxwell.child_draw = function (id, image_id, x, y, width, height, cache_slot) {
+    let req = child_draw_request_new(id, x, y, width, height, cache_slot);
 
-    if (!child)
+    if (!req)
         return;
 
     /* Get image data */
@@ -269,10 +1097,9 @@ window.maxwell.child_draw = function (id, image_id, x, y, width, height) {
     xhr.open('GET', 'maxwell:///' + image_id);
     xhr.responseType = 'arraybuffer';
     xhr.addEventListener('load', on_child_draw_load);
-    xhr.maxwell = { child, x, y, width, height };
-
-    /* Add request to stack */
-    child.maxwell.draw_requests.push(xhr);
+    xhr.addEventListener('error', on_child_draw_load);
+    xhr.maxwell = req;
+    req.draw.xhr = xhr;
 
     try {
         xhr.send();
@@ -280,6 +1107,85 @@ window.maxwell.child_draw = function (id, image_id, x, y, width, height) {
     }
 }
 
+/* child_draw_inline()
+ *
+ * Same as child_draw() but with the image data base64 encoded in the command
+ * itself, used for small frames so they are painted without a round trip.
+ */
+window.maxwell.child_draw_inline = function (id, pixels, x, y, width, height, cache_slot) {
+    let child = children_hash[id];
+    let scale = window.devicePixelRatio;
+    let image = null;
+
+    try {
+        let bytes = atob(pixels);
+        let data = new Uint8ClampedArray(bytes.length);
+
+        for (let i = 0, len = bytes.length; i < len; i++)
+            data[i] = bytes.charCodeAt(i);
+
+        image = new ImageData(data, width * scale, height * scale);
+    } catch (error) {
+        console.log(error);
+    }
+
+    if (cache_slot) {
+        let entry = { slot: cache_slot, image, done: true, waiting: [] };
+
+        frame_cache[cache_slot] = entry;
+
+        if (!image)
+            frame_cache_failed(entry, child ? [child] : []);
+    }
+
+    if (!child)
+        return;
+
+    /* Still goes through the queue so it is not painted before older frames */
+    child.maxwell.draw_requests.push({ x, y, width, height, image, done: true });
+    child_flush_draw_requests(child);
+}
+
+/* child_draw_cached()
+ *
+ * Draw child canvas with the image in frame cache slot
+ */
+window.maxwell.child_draw_cached = function (id, cache_slot, x, y, width, height) {
+    let child = children_hash[id];
+    let entry = frame_cache[cache_slot];
+
+    if (!child)
+        return;
+
+    /* Failed, MaxwellWebView sends this child again once it learns */
+    if (!entry) {
+        window.webkit.messageHandlers.maxwell_frame_cache_failed.postMessage([cache_slot, id]);
+        return;
+    }
+
+    child.maxwell.draw_requests.push({ x, y, width, height, entry });
+
+    if (entry.done)
+        child_flush_draw_requests(child);
+    else
+        entry.waiting.push(child);
+}
+
+/* child_scroll()
+ *
+ * Move a rectangle of the canvas contents by dx, dy, once every previous
+ * draw is painted
+ */
+window.maxwell.child_scroll = function (id, x, y, width, height, dx, dy) {
+    let child = children_hash[id];
+
+    if (!child)
+        return;
+
+    child.maxwell.draw_requests.push({ x, y, width, height, scroll: { dx, dy }, done: true });
+    child_flush_draw_requests(child);
+}
+
 /* child_set_visible()
  *
  * Show/hide widget element
@@ -290,7 +1196,22 @@ window.maxwell.child_set_visible = function (id, visible) {
     if (!child)
         return;
 
-    child.style.display = (visible) ? child.maxwell.display_value : 'none';
+    child_set_style(child, { display: (visible) ? child.maxwell.display_value : 'none' });
+}
+
+/* Let MaxwellWebView know it can start sending commands, no need to wait for
+ * the page to finish loading
+ */
+window.webkit.messageHandlers.maxwell_ready.postMessage(null);
+
+/* Nothing is sent while the page can not be seen */
+function on_visibility_change () {
+    window.webkit.messageHandlers.maxwell_visibility.postMessage(document.hidden);
 }
 
+document.addEventListener('visibilitychange', on_visibility_change);
+
+if (document.hidden)
+    on_visibility_change();
+
 })();
@@ -0,0 +1,151 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * maxwell-test.c
+ *
+ * Copyright (C) 2018 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Author: Juan Pablo Ugarte <ugarte@endlessm.com>
+ *
+ */
+
+/*
+ * Tests for the C damage paths, run with `meson test`.
+ *
+ * Tests are skipped without a display.
+ */
+
+/* We want to test static functions */
+#include "maxwell-web-view.c"
+
+#define SCROLL_VIEW_SIZE 200
+
+typedef struct
+{
+  GtkWidget      *window;
+  MaxwellWebView *webview;
+  GtkWidget      *scrolled;
+  GtkAdjustment  *vadjustment;
+  ChildData      *data;
+} ScrollFixture;
+
+static void
+scroll_fixture_setup (ScrollFixture *fixture, gconstpointer user_data)
+{
+  MaxwellWebViewPrivate *priv;
+  GtkWidget *viewport, *area;
+  GtkAllocation alloc = { 0, 0, SCROLL_VIEW_SIZE, SCROLL_VIEW_SIZE };
+
+  fixture->window = gtk_offscreen_window_new ();
+  fixture->webview = MAXWELL_WEB_VIEW (maxwell_web_view_new ());
+  fixture->scrolled = gtk_scrolled_window_new (NULL, NULL);
+  area = gtk_drawing_area_new ();
+  gtk_widget_set_size_request (area, SCROLL_VIEW_SIZE * 4, SCROLL_VIEW_SIZE * 4);
+
+  gtk_widget_set_name (fixture->scrolled, "scrolled");
+  gtk_container_add (GTK_CONTAINER (fixture->scrolled), area);
+  gtk_container_add (GTK_CONTAINER (fixture->webview), fixture->scrolled);
+  gtk_container_add (GTK_CONTAINER (fixture->window), GTK_WIDGET (fixture->webview));
+  gtk_widget_show_all (fixture->window);
+
+  priv = MAXWELL_WEB_VIEW_PRIVATE (fixture->webview);
+  fixture->data = get_child_data_by_child (priv, fixture->scrolled);
+  g_assert_nonnull (fixture->data);
+
+  /* The page would set the child size, do it here instead */
+  ensure_offscreen (GTK_WIDGET (fixture->webview), fixture->data);
+  fixture->data->alloc = alloc;
+
+  viewport = gtk_bin_get_child (GTK_BIN (fixture->scrolled));
+  gtk_widget_realize (viewport);
+  gtk_widget_size_allocate (fixture->scrolled, &alloc);
+
+  fixture->vadjustment = gtk_scrolled_window_get_vadjustment (GTK_SCROLLED_WINDOW (fixture->scrolled));
+  g_assert_cmpfloat (gtk_adjustment_get_upper (fixture->vadjustment), >,
+                     gtk_adjustment_get_page_size (fixture->vadjustment));
+
+  /* Hold damage like a background flush interval does */
+  maxwell_web_view_freeze_updates (fixture->webview);
+}
+
+static void
+scroll_fixture_teardown (ScrollFixture *fixture, gconstpointer user_data)
+{
+  gtk_widget_destroy (fixture->window);
+}
+
+static void
+schedule_damage (ScrollFixture *fixture, gint x, gint y, gint width, gint height)
+{
+  GdkRectangle rect = { x, y, width, height };
+  cairo_region_t *region = cairo_region_create_rectangle (&rect);
+
+  child_schedule_damage (fixture->webview, fixture->data, region);
+  cairo_region_destroy (region);
+}
+
+/* GTK repaints the whole viewport after a scroll */
+static void
+test_scroll_plain (ScrollFixture *fixture, gconstpointer user_data)
+{
+  gtk_adjustment_set_value (fixture->vadjustment, 20);
+  schedule_damage (fixture, 0, 0, SCROLL_VIEW_SIZE, SCROLL_VIEW_SIZE);
+
+  g_assert_true (fixture->data->scrolled == fixture->scrolled);
+  g_assert_cmpint (fixture->data->scroll_dy, ==, 20);
+  g_assert_false (fixture->data->scroll_mixed);
+}
+
+/* A repaint the page never got must not be copied around by the scroll */
+static void
+test_scroll_after_partial_damage (ScrollFixture *fixture, gconstpointer user_data)
+{
+  MaxwellWebViewPrivate *priv = MAXWELL_WEB_VIEW_PRIVATE (fixture->webview);
+  cairo_region_t *remaining;
+
+  schedule_damage (fixture, 10, 10, 20, 20);
+  gtk_adjustment_set_value (fixture->vadjustment, 20);
+  schedule_damage (fixture, 0, 0, SCROLL_VIEW_SIZE, SCROLL_VIEW_SIZE);
+
+  g_assert_true (fixture->data->scroll_mixed);
+
+  /* What the flush would do, the whole damage has to be sent */
+  remaining = child_send_scroll (fixture->webview, fixture->data,
+                                 fixture->data->scheduled);
+  g_assert_null (remaining);
+  g_assert_cmpuint (priv->stats.scrolls, ==, 0);
+  g_assert_null (fixture->data->scrolled);
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  if (!gtk_init_check (&argc, &argv))
+    {
+      g_printerr ("No display available, skipping tests\n");
+      return 77;
+    }
+
+  g_test_add ("/scroll/plain", ScrollFixture, NULL,
+              scroll_fixture_setup, test_scroll_plain, scroll_fixture_teardown);
+  g_test_add ("/scroll/after-partial-damage", ScrollFixture, NULL,
+              scroll_fixture_setup, test_scroll_after_partial_damage,
+              scroll_fixture_teardown);
+
+  return g_test_run ();
+}
@@ -0,0 +1,433 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * maxwell-replay.c
+ *
+ * Copyright (C) 2018 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Author: Juan Pablo Ugarte <ugarte@endlessm.com>
+ *
+ */
+
+/*
+ * maxwell-replay: replays a MAXWELL_TRACE file through the frame pipeline
+ * without a display, as fast as possible, and prints how long it took.
+ *
+ * Frames take the same path they took in the recorded session, which the
+ * draw command recorded after each frame tells: cached frames are hashed,
+ * inline frames converted and base64 encoded, the rest are pushed to a
+ * MaxwellBroker and then fetched by the recorded maxwell:// requests or
+ * read from the view frame stream.
+ *
+ * Geometry records need a page and a display to be replayed, they are only
+ * counted.
+ */
+
+#include <string.h>
+
+#include "maxwell-broker.h"
+#include "maxwell-frame.h"
+#include "maxwell-trace.h"
+
+/* Same as FRAME_CACHE_MAX_SIZE, MaxwellWebView hashes frames up to this size */
+#define REPLAY_CACHE_MAX_SIZE (128 * 1024)
+
+typedef struct
+{
+  guint64 frames;
+  guint64 pixel_bytes;
+  guint64 cached;
+  guint64 inlined;
+  guint64 pushed;
+  guint64 streamed;
+  guint64 scripts;
+  guint64 script_bytes;
+  guint64 geometry;
+  guint64 requests;
+  guint64 fetched_bytes;
+  gint64  trace_time;         /* Duration of the original session */
+} ReplayStats;
+
+typedef struct
+{
+  guint               id;       /* Broker view id */
+  GQueue              frames;   /* FRAME events waiting for their draw command */
+  GHashTable         *ids;      /* Recorded frame id -> broker frame id */
+  MaxwellFrameStream *stream;   /* Open frame stream, if any */
+} ReplayView;
+
+typedef struct
+{
+  MaxwellBroker *broker;
+  GHashTable    *views;         /* Recorded view id -> ReplayView */
+  ReplayStats   *stats;
+  guint          fetching;      /* Fetches waiting for the broker */
+  guint64        stream_bytes;  /* Bytes pushed to streams and not read yet */
+} Replay;
+
+static void
+replay_view_free (Replay *replay, ReplayView *view)
+{
+  if (view->stream)
+    {
+      _maxwell_frame_stream_end (view->stream);
+      g_object_unref (view->stream);
+    }
+
+  _maxwell_broker_unregister_view (replay->broker, view->id);
+
+  g_queue_foreach (&view->frames, (GFunc) g_free, NULL);
+  g_queue_clear (&view->frames);
+  g_hash_table_unref (view->ids);
+  g_slice_free (ReplayView, view);
+}
+
+static ReplayView *
+replay_get_view (Replay *replay, guint view_id)
+{
+  ReplayView *view = g_hash_table_lookup (replay->views, GUINT_TO_POINTER (view_id));
+
+  if (view)
+    return view;
+
+  view = g_slice_new0 (ReplayView);
+  view->id = _maxwell_broker_register_view (replay->broker, NULL);
+  view->ids = g_hash_table_new (g_direct_hash, g_direct_equal);
+  g_hash_table_insert (replay->views, GUINT_TO_POINTER (view_id), view);
+
+  return view;
+}
+
+/* What MaxwellWebView child_capture() does */
+static cairo_surface_t *
+replay_capture (Replay *replay, MaxwellTraceEvent *event)
+{
+  cairo_surface_t *image;
+
+  image = _maxwell_broker_get_surface (replay->broker, event->width, event->height);
+  cairo_surface_flush (image);
+  memcpy (cairo_image_surface_get_data (image), event->data,
+          (gsize) event->width * event->height * 4);
+  cairo_surface_mark_dirty (image);
+
+  if (event->len <= REPLAY_CACHE_MAX_SIZE)
+    _maxwell_frame_hash (image);
+
+  replay->stats->frames++;
+
+  return image;
+}
+
+static void
+replay_draw_inline (Replay *replay, cairo_surface_t *image)
+{
+  GBytes *bytes = _maxwell_frame_from_surface (image);
+  gchar *pixels = g_base64_encode (g_bytes_get_data (bytes, NULL),
+                                   g_bytes_get_size (bytes));
+
+  replay->stats->inlined++;
+  replay->stats->pixel_bytes += g_bytes_get_size (bytes);
+
+  g_free (pixels);
+  g_bytes_unref (bytes);
+  cairo_surface_destroy (image);
+}
+
+static void
+replay_draw_pushed (Replay          *replay,
+                    ReplayView      *view,
+                    cairo_surface_t *image,
+                    guint            recorded_id)
+{
+  gsize size = (gsize) cairo_image_surface_get_width (image) *
+               cairo_image_surface_get_height (image) * 4;
+  gboolean streamed;
+  guint id;
+
+  if (!(id = _maxwell_broker_push_frame (replay->broker, view->id, image, &streamed)))
+    return;
+
+  replay->stats->pixel_bytes += size;
+
+  if (streamed)
+    {
+      replay->stats->streamed++;
+      replay->stream_bytes += 8 + size;
+    }
+  else
+    {
+      replay->stats->pushed++;
+      g_hash_table_insert (view->ids, GUINT_TO_POINTER (recorded_id),
+                           GUINT_TO_POINTER (id));
+    }
+}
+
+/* Skips the child name, returns what follows it or NULL */
+static const gchar *
+skip_child_name (const gchar *args)
+{
+  if (*args != '\'' || !(args = strchr (args + 1, '\'')))
+    return NULL;
+
+  return (args[1] == ',') ? args + 2 : NULL;
+}
+
+/*
+ * Every frame is followed by one draw command, in the same order, telling
+ * which path it took.
+ */
+static void
+replay_script (Replay *replay, MaxwellTraceEvent *event)
+{
+  gchar *script = g_strndup ((const gchar *) event->data, event->len);
+  ReplayView *view = replay_get_view (replay, event->view_id);
+  const gchar *p = script;
+
+  replay->stats->scripts++;
+  replay->stats->script_bytes += event->len;
+
+  while ((p = strstr (p, "maxwell.child_draw")))
+    {
+      MaxwellTraceEvent *frame;
+      cairo_surface_t *image;
+      const gchar *args;
+
+      p += strlen ("maxwell.child_draw");
+
+      if (!(frame = g_queue_pop_head (&view->frames)))
+        continue;
+
+      image = replay_capture (replay, frame);
+      g_free (frame);
+
+      if (g_str_has_prefix (p, "_cached ("))
+        {
+          replay->stats->cached++;
+          cairo_surface_destroy (image);
+        }
+      else if (g_str_has_prefix (p, "_inline ("))
+        replay_draw_inline (replay, image);
+      else if (g_str_has_prefix (p, "_streamed (") &&
+               (args = skip_child_name (p + strlen ("_streamed ("))))
+        replay_draw_pushed (replay, view, image, g_ascii_strtoull (args, NULL, 10));
+      else if (g_str_has_prefix (p, " (") &&
+               (args = skip_child_name (p + strlen (" ("))) &&
+               (args = strchr (args, '/')))
+        replay_draw_pushed (replay, view, image, g_ascii_strtoull (args + 1, NULL, 10));
+      else
+        cairo_surface_destroy (image);
+    }
+
+  g_free (script);
+}
+
+static void
+on_replay_fetch (GBytes *bytes, const GError *error, Replay *replay)
+{
+  if (bytes)
+    replay->stats->fetched_bytes += g_bytes_get_size (bytes);
+
+  replay->fetching--;
+}
+
+/* Reads whatever the page would have read from the frame streams */
+static void
+replay_read_streams (Replay *replay)
+{
+  static guint8 buffer[64 * 1024];
+  GHashTableIter iter;
+  ReplayView *view;
+
+  g_hash_table_iter_init (&iter, replay->views);
+
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &view))
+    {
+      gssize n;
+
+      if (!view->stream)
+        continue;
+
+      while ((n = g_pollable_input_stream_read_nonblocking (G_POLLABLE_INPUT_STREAM (view->stream),
+                                                            buffer, sizeof (buffer),
+                                                            NULL, NULL)) > 0)
+        {
+          replay->stats->fetched_bytes += n;
+          replay->stream_bytes -= MIN ((guint64) n, replay->stream_bytes);
+        }
+    }
+}
+
+static void
+replay_request (Replay *replay, MaxwellTraceEvent *event)
+{
+  gchar *path = g_strndup ((const gchar *) event->data, event->len);
+  ReplayView *view = replay_get_view (replay, event->view_id);
+  const gchar *frame = strchr (path + (*path == '/'), '/');
+
+  replay->stats->requests++;
+
+  if (frame && g_str_equal (frame, "/stream"))
+    {
+      if (view->stream)
+        {
+          /* Whatever the page did not read is lost with the old stream */
+          replay_read_streams (replay);
+          _maxwell_frame_stream_end (view->stream);
+          g_object_unref (view->stream);
+        }
+
+      view->stream = _maxwell_broker_open_stream (replay->broker, view->id);
+    }
+  else if (frame)
+    {
+      gpointer id = g_hash_table_lookup (view->ids,
+                                         GUINT_TO_POINTER (g_ascii_strtoull (frame + 1, NULL, 10)));
+
+      /* The callback can run before this returns */
+      replay->fetching++;
+
+      if (!id || !_maxwell_broker_fetch_frame (replay->broker, view->id,
+                                               GPOINTER_TO_UINT (id),
+                                               (MaxwellBrokerFetchFunc) on_replay_fetch,
+                                               replay))
+        replay->fetching--;
+    }
+
+  g_free (path);
+}
+
+/* Runs finished broker jobs */
+static void
+replay_dispatch (Replay *replay, gboolean wait)
+{
+  while (g_main_context_iteration (NULL, wait))
+    wait = FALSE;
+
+  replay_read_streams (replay);
+}
+
+static void
+replay (MaxwellBroker *broker, MaxwellTraceReader *reader, ReplayStats *stats)
+{
+  Replay replay = { broker, NULL, stats, 0, 0 };
+  MaxwellTraceEvent event;
+  GHashTableIter iter;
+  ReplayView *view;
+
+  replay.views = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+  _maxwell_trace_reader_rewind (reader);
+
+  while (_maxwell_trace_reader_next (reader, &event))
+    {
+      switch (event.type)
+        {
+        case MAXWELL_TRACE_FRAME:
+          /* Pixels are mapped, they stay valid until the reader is freed */
+          view = replay_get_view (&replay, event.view_id);
+          g_queue_push_tail (&view->frames, g_memdup (&event, sizeof (event)));
+          break;
+        case MAXWELL_TRACE_SCRIPT:
+          replay_script (&replay, &event);
+          break;
+        case MAXWELL_TRACE_GEOMETRY:
+          stats->geometry++;
+          break;
+        case MAXWELL_TRACE_REQUEST:
+          replay_request (&replay, &event);
+          break;
+        }
+
+      replay_dispatch (&replay, FALSE);
+      stats->trace_time = event.time;
+    }
+
+  /* Wait for every frame the page asked for */
+  while (replay.fetching || replay.stream_bytes)
+    replay_dispatch (&replay, TRUE);
+
+  g_hash_table_iter_init (&iter, replay.views);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &view))
+    replay_view_free (&replay, view);
+
+  g_hash_table_unref (replay.views);
+}
+
+int
+main (int argc, char *argv[])
+{
+  MaxwellTraceReader *reader;
+  WebKitWebContext *context;
+  MaxwellBroker *broker;
+  ReplayStats stats = { 0, };
+  GError *error = NULL;
+  gint iterations = 1, i;
+  gint64 start, elapsed;
+
+  if (argc < 2 || argc > 3)
+    {
+      g_printerr ("Usage: %s TRACE [ITERATIONS]\n", argv[0]);
+      return 1;
+    }
+
+  if (argc == 3 && (iterations = g_ascii_strtoll (argv[2], NULL, 10)) <= 0)
+    {
+      g_printerr ("Invalid number of iterations %s\n", argv[2]);
+      return 1;
+    }
+
+  if (!(reader = _maxwell_trace_reader_new (argv[1], &error)))
+    {
+      g_printerr ("%s\n", error->message);
+      g_error_free (error);
+      return 1;
+    }
+
+  /* Nothing is loaded, the context only holds the broker */
+  context = webkit_web_context_new ();
+  broker = _maxwell_broker_get_for_context (context);
+
+  start = g_get_monotonic_time ();
+
+  for (i = 0; i < iterations; i++)
+    replay (broker, reader, &stats);
+
+  elapsed = MAX (g_get_monotonic_time () - start, 1);
+
+  /* One key value pair per line so results are easy to compare */
+  g_print ("iterations %d\n", iterations);
+  g_print ("trace_time_us %" G_GINT64_FORMAT "\n", stats.trace_time);
+  g_print ("replay_time_us %" G_GINT64_FORMAT "\n", elapsed / iterations);
+  g_print ("frames %" G_GUINT64_FORMAT "\n", stats.frames / iterations);
+  g_print ("pixel_bytes %" G_GUINT64_FORMAT "\n", stats.pixel_bytes / iterations);
+  g_print ("cached %" G_GUINT64_FORMAT "\n", stats.cached / iterations);
+  g_print ("inlined %" G_GUINT64_FORMAT "\n", stats.inlined / iterations);
+  g_print ("pushed %" G_GUINT64_FORMAT "\n", stats.pushed / iterations);
+  g_print ("streamed %" G_GUINT64_FORMAT "\n", stats.streamed / iterations);
+  g_print ("scripts %" G_GUINT64_FORMAT "\n", stats.scripts / iterations);
+  g_print ("script_bytes %" G_GUINT64_FORMAT "\n", stats.script_bytes / iterations);
+  g_print ("geometry %" G_GUINT64_FORMAT "\n", stats.geometry / iterations);
+  g_print ("requests %" G_GUINT64_FORMAT "\n", stats.requests / iterations);
+  g_print ("fetched_bytes %" G_GUINT64_FORMAT "\n", stats.fetched_bytes / iterations);
+  g_print ("frames_per_second %.1f\n", stats.frames * (gdouble) G_USEC_PER_SEC / elapsed);
+  g_print ("megabytes_per_second %.1f\n",
+           stats.pixel_bytes * (gdouble) G_USEC_PER_SEC / elapsed / (1024 * 1024));
+
+  g_object_unref (context);
+  _maxwell_trace_reader_free (reader);
+
+  return 0;
+}